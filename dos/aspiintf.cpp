@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <dos.h>
 #include <i86.h>
+#include <io.h>
 #include <fcntl.h>
 #include <share.h>
 #include <time.h>
@@ -28,6 +29,7 @@
 
 #include "../include/aspi.h"
 #include "../include/scsidefs.h"
+#include "../include/toolbox.h"
 #include "../include/estb.h"
 
 typedef unsigned short (__pascal far *Aspiproc)(void far *pSrb);
@@ -49,34 +51,267 @@ static void Spinner(void) {
 }
 
 
+/* Commands are grouped in classes with similar expected latency. Each class
+ * keeps a running average and mean deviation of the observed latency (as TCP
+ * does for round trip times), and the timeout follows those, within limits.
+ * A timeout given on the command line replaces the adaptive timeout. */
+enum TimeoutClass {
+    TIMEOUT_PROBE = 0,  /* enumeration and device status queries */
+    TIMEOUT_CONTROL,    /* listings and other small toolbox commands */
+    TIMEOUT_TRANSFER,   /* file and disk block transfers */
+    NUM_TIMEOUT_CLASSES
+};
+
+struct CommandTimeout {
+    const char *name;
+    unsigned long initial_ms;
+    unsigned long min_ms;
+    unsigned long max_ms;
+    unsigned long fixed_ms;     /* set from the command line, 0 means adaptive */
+    unsigned long avg_ms;       /* smoothed latency, 0 before the first sample */
+    unsigned long dev_ms;       /* smoothed mean deviation of latency */
+};
+
+static CommandTimeout _timeouts[NUM_TIMEOUT_CLASSES] = {
+    { "probe",      3000,  1000,  10000, 0, 0, 0 },
+    { "control",   10000,  5000,  60000, 0, 0, 0 },
+    { "transfer",  30000, 10000, 120000, 0, 0, 0 },
+};
+
+static int GetTimeoutClass(void far *pSrb)
+{
+    PSRB_Header header = (PSRB_Header)pSrb;
+
+    if (header->SRB_Cmd != SC_EXEC_SCSI_CMD) return TIMEOUT_PROBE;
+
+    // The CDB is at the same offset for all CDB lengths
+    switch (((PSRB_ExecSCSICmd6)pSrb)->CDBByte[0]) {
+        case SCSI_TST_U_RDY:
+        case SCSI_REQ_SENSE:
+        case SCSI_INQUIRY:
+        case TOOLBOX_LIST_DEVICES:
+            return TIMEOUT_PROBE;
+        case SCSI_READ10:
+        case SCSI_WRITE10:
+        case TOOLBOX_GET_FILE:
+        case TOOLBOX_SEND_FILE_10:
+            return TIMEOUT_TRANSFER;
+        default:
+            return TIMEOUT_CONTROL;
+    }
+}
+
+static unsigned long GetTimeoutMs(const CommandTimeout &ct)
+{
+    if (ct.fixed_ms) return ct.fixed_ms;
+    if (ct.avg_ms == 0) return ct.initial_ms;
+
+    unsigned long timeout_ms = 4 * (ct.avg_ms + 4 * ct.dev_ms);
+    if (timeout_ms < ct.min_ms) return ct.min_ms;
+    if (timeout_ms > ct.max_ms) return ct.max_ms;
+    return timeout_ms;
+}
+
+static void UpdateTimeout(CommandTimeout &ct, unsigned long elapsed_ms)
+{
+    // Never let the average reach zero, which means no samples yet
+    if (elapsed_ms == 0) elapsed_ms = 1;
+
+    if (ct.avg_ms == 0) {
+        ct.avg_ms = elapsed_ms;
+        ct.dev_ms = elapsed_ms / 2;
+        return;
+    }
+
+    unsigned long diff = elapsed_ms > ct.avg_ms ? elapsed_ms - ct.avg_ms : ct.avg_ms - elapsed_ms;
+    ct.dev_ms = (3 * ct.dev_ms + diff) / 4;
+    ct.avg_ms = (7 * ct.avg_ms + elapsed_ms) / 8;
+    if (ct.avg_ms == 0) ct.avg_ms = 1;
+}
+
+bool SetASPITimeouts(const char *spec)
+{
+    // Either a number of seconds for all classes, or a comma separated list of class:seconds
+    unsigned long seconds;
+    int len;
+    if (sscanf(spec, "%lu%n", &seconds, &len) == 1 && spec[len] == '\0') {
+        for (int tc = 0; tc < NUM_TIMEOUT_CLASSES; tc++) _timeouts[tc].fixed_ms = seconds * 1000;
+        return seconds > 0;
+    }
+
+    while (*spec != '\0') {
+        const char *colon = strchr(spec, ':');
+        if (colon == NULL) return false;
+        if (sscanf(colon + 1, "%lu%n", &seconds, &len) != 1 || seconds == 0) return false;
+
+        int tc;
+        for (tc = 0; tc < NUM_TIMEOUT_CLASSES; tc++) {
+            if (strnicmp(spec, _timeouts[tc].name, colon - spec) == 0 &&
+                    _timeouts[tc].name[colon - spec] == '\0') {
+                _timeouts[tc].fixed_ms = seconds * 1000;
+                break;
+            }
+        }
+        if (tc == NUM_TIMEOUT_CLASSES) return false;
+
+        spec = colon + 1 + len;
+        if (*spec == ',') spec++;
+        else if (*spec != '\0') return false;
+    }
+    return true;
+}
+
+
+/* How to pass the time while waiting for a command to complete.
+ * Busy waiting steals time from other virtual machines under Windows
+ * and other multitaskers, so by default the time slice is given back. */
+enum WaitMode {
+    WAIT_AUTO = 0,  /* release time slice under a multitasker, otherwise DOS idle */
+    WAIT_SPIN,      /* poll continuously */
+    WAIT_YIELD,     /* DOS idle interrupt only */
+    WAIT_HALT,      /* halt the processor until the next interrupt */
+};
+
+static int _wait_mode = WAIT_AUTO;
+static bool _multitasker = false;
+
+/* Commands that complete quickly should not pay for a yield,
+ * so poll this many times before starting to give up time */
+static const int WAIT_SPIN_POLLS = 100;
+
+void CpuHalt(void);
+#pragma aux CpuHalt = "sti" "hlt";
+
+bool SetASPIWaitMode(const char *mode)
+{
+    if (stricmp(mode, "auto") == 0) {
+        _wait_mode = WAIT_AUTO;
+    } else if (stricmp(mode, "spin") == 0) {
+        _wait_mode = WAIT_SPIN;
+    } else if (stricmp(mode, "yield") == 0) {
+        _wait_mode = WAIT_YIELD;
+    } else if (stricmp(mode, "halt") == 0) {
+        _wait_mode = WAIT_HALT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool ReleaseTimeSlice(void)
+{
+    union REGS regs;
+
+    /* Supported by Windows 3.x/9x enhanced mode, OS/2, DESQview and others.
+     * Returns AL = 0 when supported. */
+    regs.w.ax = 0x1680;
+    int86(0x2F, &regs, &regs);
+    return regs.h.al == 0;
+}
+
+static void DetectMultitasker(void)
+{
+    _multitasker = ReleaseTimeSlice();
+}
+
+static void IdleWait(void)
+{
+    union REGS regs;
+
+    switch (_wait_mode) {
+        case WAIT_SPIN:
+            break;
+        case WAIT_HALT:
+            CpuHalt();
+            break;
+        case WAIT_AUTO:
+            if (_multitasker) {
+                ReleaseTimeSlice();
+                break;
+            }
+            /* fall through */
+        case WAIT_YIELD:
+            /* DOS idle interrupt, lets TSRs do background work */
+            int86(0x28, &regs, &regs);
+            break;
+    }
+}
+
+/* The spinner is only shown for commands taking longer than SPINDELAY,
+ * and only when the output is going to the screen */
+static bool _spinner_enabled = false;
+static clock_t SPINDELAY = CLOCKS_PER_SEC;
 static clock_t WAITSTEP = CLOCKS_PER_SEC / 4;
-static int TIMEOUT = 40;
-static int WaitForASPI(BYTE *status)
+static int WaitForASPI(BYTE *status, unsigned long timeout_ms)
 {
-    int counter = 0;
-    clock_t timeout = clock() + WAITSTEP;
+    clock_t start = clock();
+    clock_t deadline = start + (clock_t)(timeout_ms * CLOCKS_PER_SEC / 1000);
+    clock_t spin = start + SPINDELAY;
     clock_t t;
+    int polls = 0;
 
     while (*status == SS_PENDING) {
         t = clock();
-        if (t >= timeout) {
+        if (_spinner_enabled && t >= spin) {
             Spinner();
-            counter++;
-            timeout = t + WAITSTEP;
+            spin = t + WAITSTEP;
+        }
+        if (t >= deadline) break;
+        if (polls < WAIT_SPIN_POLLS) {
+            polls++;
+        } else {
+            IdleWait();
         }
-        if (counter > TIMEOUT) break;
     }
 
     return *status;
 }
 
-unsigned short far SendASPICommand(void far *pSrb)
+static void AbortASPICommand(void far *pSrb)
+{
+    PSRB_Header header = (PSRB_Header)pSrb;
+    SRB_Abort abortsrb;
+
+    memset(&abortsrb, 0, sizeof(abortsrb));
+    abortsrb.SRB_Cmd = SC_ABORT_SRB;
+    abortsrb.SRB_HaId = header->SRB_HaId;
+    abortsrb.SRB_ToAbort = pSrb;
+    _aspiproc(&abortsrb);
+    WaitForASPI(&abortsrb.SRB_Status, 2000);
+
+    // Give the aborted command a moment to get its final status
+    WaitForASPI(&header->SRB_Status, 1000);
+}
+
+/* Wait for a command already handed to the ASPI manager, and abort it on timeout.
+ * The timeout counts from when the command was posted. */
+static unsigned short WaitASPICommand(void far *pSrb, clock_t posted)
 {
     PSRB_Header header = (PSRB_Header)pSrb;
+    CommandTimeout &ct = _timeouts[GetTimeoutClass(pSrb)];
+    unsigned long timeout_ms = GetTimeoutMs(ct);
+    unsigned long waited_ms = (unsigned long)(clock() - posted) * 1000 / CLOCKS_PER_SEC;
+
+    WaitForASPI(&header->SRB_Status, waited_ms < timeout_ms ? timeout_ms - waited_ms : 0);
+    if (header->SRB_Status == SS_PENDING && header->SRB_Cmd == SC_EXEC_SCSI_CMD) {
+        // Do not leave a pending command behind, if the ASPI manager can abort it.
+        // If it can not, the caller sees SS_PENDING and must leave the SRB alone.
+        fprintf(stderr, "\nCommand timed out after %lu ms, aborting\n", timeout_ms);
+        AbortASPICommand(pSrb);
+    } else if (header->SRB_Status == SS_COMP) {
+        UpdateTimeout(ct, (unsigned long)(clock() - posted) * 1000 / CLOCKS_PER_SEC);
+    }
+
+    return header->SRB_Status;
+}
+
+unsigned short far SendASPICommand(void far *pSrb)
+{
+    clock_t start = clock();
 
     _aspiproc(pSrb);
 
-    return WaitForASPI(&header->SRB_Status);
+    return WaitASPICommand(pSrb, start);
 }
 
 int InitASPI(void)
@@ -106,9 +341,20 @@ int InitASPI(void)
 
     _aspiproc = (Aspiproc)entrypoint;
 
+    DetectMultitasker();
+    _spinner_enabled = isatty(fileno(stdout)) != 0;
+
     return _aspiproc != NULL;
 }
 
+/* Real mode address of a far pointer. With a memory manager running the
+ * machine in virtual 8086 mode, this is what the ASPI driver sees as well,
+ * and the driver translates it to the true physical address. */
+static unsigned long PhysicalAddress(const void far *p)
+{
+    return ((unsigned long)FP_SEG(p) << 4) + FP_OFF(p);
+}
+
 struct DosScsiCommand : public ScsiCommand {
     union {
         // All of these structs are identical up until CDBByte,
@@ -118,9 +364,69 @@ struct DosScsiCommand : public ScsiCommand {
         SRB_ExecSCSICmd10 srb10;
         SRB_ExecSCSICmd12 srb12;
     };
+    unsigned char far *raw_buf;     /* allocated block, data_buf is placed within */
+    unsigned int raw_size;
+    unsigned int buf_capacity;
+    unsigned short buf_align_mask;  /* alignment data_buf was placed for */
+    bool in_use;
+    clock_t posted_clock;
+    unsigned long posted_ticks;
+
+    DosScsiCommand() : raw_buf(NULL), raw_size(0), buf_capacity(0), buf_align_mask(0), in_use(false)
+    {
+        data_buf = NULL;
+        cdb = NULL;
+        device = NULL;
+    }
 
-    DosScsiCommand(const Device *dev, unsigned char cdbsize, int bufsize, unsigned char flags)
+    /* Allocate a data buffer aligned as the adapter requires, and not crossing
+     * a 64 kB DMA page. Otherwise many ASPI drivers quietly copy the data through
+     * a bounce buffer of their own, and some refuse with SS_BUFFER_ALIGN.
+     * First try a block just large enough for the alignment, and only when that
+     * lands on a page boundary, one large enough to always have room. */
+    bool AllocBuffer(unsigned int bufsize, unsigned short align_mask)
     {
+        unsigned long rawsize = (unsigned long)bufsize + align_mask;
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (rawsize > 0xFFF0UL) rawsize = bufsize;
+            unsigned char far *newbuf = new unsigned char[(unsigned int)rawsize];
+            if (newbuf == NULL) return false;
+
+            unsigned long offset = DmaBufferOffset(PhysicalAddress(newbuf), rawsize, bufsize, align_mask);
+            if (offset == DMA_NO_FIT && attempt == 0 && 2UL * bufsize + align_mask <= 0xFFF0UL) {
+                delete[] newbuf;
+                rawsize = 2UL * bufsize + align_mask;
+                if (_stats_enabled) StatsRecordDmaRealign();
+                continue;
+            }
+
+            if (_stats_enabled) {
+                StatsRecordHeapFree(raw_size);
+                StatsRecordHeapAlloc(rawsize);
+            }
+            delete[] raw_buf;
+            raw_buf = newbuf;
+            raw_size = (unsigned int)rawsize;
+            // A block too large to place safely is used as it is, leaving it to the driver
+            data_buf = offset == DMA_NO_FIT ? newbuf : newbuf + (unsigned int)offset;
+            buf_capacity = bufsize;
+            buf_align_mask = align_mask;
+            return true;
+        }
+        return false;
+    }
+
+    bool Init(const Device *dev, unsigned char cdbsize, int bufsize, unsigned char flags)
+    {
+        if (bufsize < 0) abort();
+
+        // The buffer is kept between uses, and only replaced when a larger one is needed,
+        // or when a device on another adapter has stricter requirements
+        unsigned short align_mask = _adapters[dev->adapter_id].alignment_mask;
+        if ((unsigned int)bufsize > buf_capacity || (align_mask & ~buf_align_mask) != 0) {
+            if (!AllocBuffer(bufsize, align_mask)) return false;
+        }
+
         switch (cdbsize) {
             case 6:
                 memset(&srb6, 0, sizeof(srb6));
@@ -141,12 +447,9 @@ struct DosScsiCommand : public ScsiCommand {
                 abort();
         }
 
-        if (bufsize < 0) abort();
-        
-        data_buf = new unsigned char[bufsize];
-        _fmemset(data_buf, 0, bufsize);
+        if (bufsize > 0) _fmemset(data_buf, 0, bufsize);
         device = dev;
-        
+
         srb6.SRB_Cmd = SC_EXEC_SCSI_CMD;
         srb6.SRB_HaId = device->adapter_id;
         srb6.SRB_Flags = flags;
@@ -155,48 +458,116 @@ struct DosScsiCommand : public ScsiCommand {
         srb6.SRB_BufLen = bufsize;
         srb6.SRB_BufPointer = data_buf;
         srb6.SRB_SenseLen = SENSE_LEN;
+        return true;
     }
+};
 
-    virtual unsigned short Execute()
-    {
-        return SendASPICommand(&srb6);
-    }
-    
-    int GetBufSize() const { return (int)srb6.SRB_BufLen; }
-    unsigned char GetCDBSize() const { return srb6.SRB_CDBLen; }
-    unsigned char GetStatus() const { return srb6.SRB_Status; }
-    unsigned char GetFlags() const { return srb6.SRB_Flags; }
-    unsigned char GetHAStatus() const { return srb6.SRB_HaStat; }
-    unsigned char GetTargetStatus() const { return srb6.SRB_TargStat; }
-    const SENSE_DATA_FMT far *GetSenseData() const
-    {
-        switch (srb6.SRB_CDBLen) {
-            case 6:
-                return (SENSE_DATA_FMT far *)(void far *)srb6.SenseArea6;
-            case 10:
-                return (SENSE_DATA_FMT far *)(void far *)srb10.SenseArea10;
-            case 12:
-                return (SENSE_DATA_FMT far *)(void far *)srb12.SenseArea12;
-            default:
-                abort();
-                return NULL;
-        }
+/* Commands are reused from a small pool, so once the buffers have grown to
+ * the transfer size, sending a command does not touch the heap. */
+const int COMMAND_POOL_SIZE = 4;
+static DosScsiCommand _command_pool[COMMAND_POOL_SIZE];
+
+/* The generic ScsiCommand functions are implemented here for the DOS ASPI
+ * backend. Only one backend is linked into a program, so there is no need
+ * for virtual functions. */
+static inline DosScsiCommand far *AsDos(ScsiCommand far *cmd)
+{
+    return static_cast<DosScsiCommand far *>(cmd);
+}
+
+static inline const DosScsiCommand far *AsDos(const ScsiCommand far *cmd)
+{
+    return static_cast<const DosScsiCommand far *>(cmd);
+}
+
+void ScsiCommand::Post()
+{
+    DosScsiCommand far *dc = AsDos(this);
+
+    // Reset the results in case the command is sent again
+    dc->srb6.SRB_Status = SS_PENDING;
+    dc->srb6.SRB_HaStat = 0;
+    dc->srb6.SRB_TargStat = 0;
+
+    dc->posted_clock = clock();
+    if (_stats_enabled || _trace_enabled) dc->posted_ticks = ReadTimerTicks();
+    _aspiproc(&dc->srb6);
+}
+
+unsigned short ScsiCommand::Wait()
+{
+    DosScsiCommand far *dc = AsDos(this);
+
+    unsigned short status = WaitASPICommand(&dc->srb6, dc->posted_clock);
+    if (!_stats_enabled && !_trace_enabled) return status;
+
+    unsigned long elapsed = ReadTimerTicks() - dc->posted_ticks;
+    if (_stats_enabled) {
+        StatsRecordCommand(cdb[0], dc->srb6.SRB_BufLen, elapsed,
+            dc->srb6.SRB_Status, dc->srb6.SRB_HaStat, dc->srb6.SRB_TargStat);
     }
+    if (_trace_enabled) TraceRecordCommand(*this, dc->posted_ticks, elapsed);
+    return status;
+}
 
-    virtual ~DosScsiCommand()
-    {
-        delete[] data_buf;
+unsigned short ScsiCommand::Execute()
+{
+    Post();
+    return Wait();
+}
+
+void ScsiCommand::Release()
+{
+    DosScsiCommand far *dc = AsDos(this);
+
+    // A command the ASPI manager could not abort may still be written to,
+    // so it is never given out again
+    if (dc->srb6.SRB_Status == SS_PENDING && dc->srb6.SRB_Cmd == SC_EXEC_SCSI_CMD) return;
+    dc->in_use = false;
+}
+
+int ScsiCommand::GetBufSize() const { return (int)AsDos(this)->srb6.SRB_BufLen; }
+unsigned char ScsiCommand::GetCDBSize() const { return AsDos(this)->srb6.SRB_CDBLen; }
+unsigned char ScsiCommand::GetStatus() const { return AsDos(this)->srb6.SRB_Status; }
+unsigned char ScsiCommand::GetFlags() const { return AsDos(this)->srb6.SRB_Flags; }
+unsigned char ScsiCommand::GetHAStatus() const { return AsDos(this)->srb6.SRB_HaStat; }
+unsigned char ScsiCommand::GetTargetStatus() const { return AsDos(this)->srb6.SRB_TargStat; }
+
+const SENSE_DATA_FMT far *ScsiCommand::GetSenseData() const
+{
+    const DosScsiCommand far *dc = AsDos(this);
+
+    switch (dc->srb6.SRB_CDBLen) {
+        case 6:
+            return (SENSE_DATA_FMT far *)(void far *)dc->srb6.SenseArea6;
+        case 10:
+            return (SENSE_DATA_FMT far *)(void far *)dc->srb10.SenseArea10;
+        case 12:
+            return (SENSE_DATA_FMT far *)(void far *)dc->srb12.SenseArea12;
+        default:
+            abort();
+            return NULL;
     }
-};
+}
 
 ScsiCommand far * Device::PrepareCommand(unsigned char cdbsize, int bufsize, unsigned char flags) const
 {
-    return new DosScsiCommand(this, cdbsize, bufsize, flags);
+    for (int i = 0; i < COMMAND_POOL_SIZE; i++) {
+        DosScsiCommand &dc = _command_pool[i];
+        if (dc.in_use) continue;
+        if (!dc.Init(this, cdbsize, bufsize, flags)) return NULL;
+        dc.in_use = true;
+        return &dc;
+    }
+    fprintf(stderr, "[%s] No free SCSI command\n", name);
+    return NULL;
 }
 
 void PrintSense(const SENSE_DATA_FMT far *s)
 {
-    printf("SENSE: err=%02x seg=%02x key=%02x info=%02x%02x%02x%02x addlen=%02x\n",
+    printf("SENSE: %s, asc=%02x ascq=%02x\n",
+        GetSenseKeyName(s->SenseKey), s->AddSenseCode, s->AddSenQual);
+    printf("       err=%02x seg=%02x key=%02x info=%02x%02x%02x%02x addlen=%02x\n",
         s->ErrorCode, s->SegmentNum, s->SenseKey,
         s->InfoByte0, s->InfoByte1, s->InfoByte2, s->InfoByte3,
         s->AddSenLen);
@@ -24,11 +24,11 @@
 #include "../include/estb.h"
 
 
-WCValOrderedVector<Adapter> _adapters(0, 1);
-WCValOrderedVector<Device> _devices(0, 8);
+FixedVector<Adapter> _adapters;
+FixedVector<Device> _devices;
 
 
-static int GetHostAdapterInfo(void)
+static int GetHostAdapterInfo(Adapter adapters[MAX_NUM_HA])
 {
     SRB_HAInquiry host_adapter_info;
     int adapter_id = 0;
@@ -52,6 +52,7 @@ static int GetHostAdapterInfo(void)
 
         if (num_adapters == 0) {
             num_adapters = host_adapter_info.HA_Count;
+            if (num_adapters > MAX_NUM_HA) num_adapters = MAX_NUM_HA;
         }
 
         /* fill Adapter struct */
@@ -81,7 +82,7 @@ static int GetHostAdapterInfo(void)
         if (ad.max_targets == 0) ad.max_targets = 8;
         if (ad.max_transfer_length == 0) ad.max_transfer_length = 0x4000; /* 16k */
 
-        _adapters.append(ad);
+        adapters[adapter_id] = ad;
     } while (++adapter_id < num_adapters);
 
     return num_adapters;
@@ -164,18 +165,36 @@ static int GetAdapterDeviceInfo(int adapter_id)
 }
 
 
-int InitSCSI()
+static int ScanSCSI()
 {
     if (!InitASPI()) {
         fprintf(stderr, "Could not obtain ASPI services, check your driver is installed.\n");
         return 255;
     }
 
-    if (GetHostAdapterInfo() == 0) {
+    Adapter adapters[MAX_NUM_HA];
+    int num_adapters = GetHostAdapterInfo(adapters);
+    if (num_adapters == 0) {
         fprintf(stderr, "No SCSI host adapters found.\n");
         return 254;
     }
 
+    // Size the tables for the largest possible number of devices, and
+    // allocate them together with the room for listings in one go
+    int max_devices = 0;
+    for (int id = 0; id < num_adapters; id++) {
+        max_devices += adapters[id].max_targets * (MAXLUN + 1);
+    }
+    if (!ArenaInit(num_adapters * sizeof(Adapter) + max_devices * sizeof(Device) +
+            ARENA_LISTING_SIZE + ToolboxListingCacheSize()) ||
+        !_adapters.reserve(num_adapters) || !_devices.reserve(max_devices)) {
+        fprintf(stderr, "Out of memory for %d devices.\n", max_devices);
+        return 252;
+    }
+    for (int id = 0; id < num_adapters; id++) {
+        _adapters.append(adapters[id]);
+    }
+
     for (int id = 0; id < _adapters.entries(); id++) {
         GetAdapterDeviceInfo(id);
     }
@@ -188,6 +207,15 @@ int InitSCSI()
     return 0;
 }
 
+/* The bus is only scanned once per session, even when several commands are run */
+int InitSCSI()
+{
+    static int result = -1;
+
+    if (result < 0) result = ScanSCSI();
+    return result;
+}
+
 int DeviceInquiry(const Device &dev, DeviceInquiryResult *res)
 {
     const int alloclen = 255;
@@ -195,7 +223,8 @@ int DeviceInquiry(const Device &dev, DeviceInquiryResult *res)
     memset(res, 0, sizeof(*res));
 
     ScsiCommand *cmd = dev.PrepareCommand(6, alloclen, SRB_DIR_IN | SRB_DIR_SCSI);
-    
+    if (cmd == NULL) return 0;
+
     cmd->cdb[0] = SCSI_INQUIRY;
     cmd->cdb[1] = 0;        // bit 0 = vital product data flag
     cmd->cdb[2] = 0;        // page code
@@ -207,11 +236,13 @@ int DeviceInquiry(const Device &dev, DeviceInquiryResult *res)
         case SS_COMP:
             break;
         case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for SCSI_INQUIRY", dev.name);
+            fprintf(stderr, "[%s] Timeout waiting for SCSI_INQUIRY\n", dev.name);
+            cmd->Release();
             return 0;
         default:
             fprintf(stderr, "[%s] Return from SCSI command SCSI_INQUIRY was %d, %d, %d\n",
                 dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
+            cmd->Release();
             return 0;
     }
 
@@ -231,7 +262,7 @@ int DeviceInquiry(const Device &dev, DeviceInquiryResult *res)
         res->toolbox_flag = 1;
     }
 
-    delete cmd;
+    cmd->Release();
 
     return 1;
 }
@@ -19,14 +19,15 @@
 
 #include <sys/types.h> 
 #include <sys/stat.h> 
+#include <dos.h>
 #include <io.h>
 #include <fcntl.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <libgen.h> 
-#include <wcvector.h>
 
 #include "../include/aspi.h"
 #include "../include/scsidefs.h"
@@ -36,8 +37,16 @@
 
 static char LETTERS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
+// Set while a script is read from standard input, the answer would be
+// taken from the script itself
+static bool _script_on_stdin = false;
+
 static bool AskForConfirmation(const char *question)
 {
+    if (_script_on_stdin) {
+        fprintf(stderr, "%s\nCan not ask while the script is read from standard input, answering no.\n", question);
+        return false;
+    }
     fprintf(stderr, "%s (Y/N) ", question);
     while(1) {
         int response = getchar();
@@ -47,6 +56,7 @@ static bool AskForConfirmation(const char *question)
                 return true;
             case 'n':
             case 'N':
+            case EOF:
                 return false;
             default:
                 continue;
@@ -77,14 +87,19 @@ static int DoDeviceInfo(int argc, const char *argv[])
     int dev_id;
     int errors = 0;
     DeviceInquiryResult di;
-    WCValOrderedVector<FoundToolboxDevice> tbdevs;
+    FixedVector<FoundToolboxDevice> tbdevs;
 
     (void)argc; // unused parameter
     (void)argv; // unused parameter
 
     if (r) return r;
 
-    //tbdevs.reserve(_devices.size());
+    // Several physical toolbox devices can share an adapter, but each has
+    // at least one device of its own
+    if (!tbdevs.reserve(_devices.entries())) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
 
     printf(
         "Addr   Vendor   Model            Type       Adapter            Emulation Dev\n"
@@ -112,9 +127,8 @@ static int DoDeviceInfo(int argc, const char *argv[])
             bool has_toolbox = ToolboxListDevices(dev, newtbdev.tdl);
             if (has_toolbox) {
                 newtbdev.adapter_id = dev.adapter_id;
-                newtbdev.name = LETTERS[tbdevs.entries()];
-                tbdevs.append(newtbdev);
-                tbdev = &tbdevs.last();
+                newtbdev.name = tbdevs.entries() < (int)sizeof(LETTERS) - 1 ? LETTERS[tbdevs.entries()] : '?';
+                if (tbdevs.append(newtbdev)) tbdev = &tbdevs.last();
             }
         }
 
@@ -134,34 +148,38 @@ static int DoDeviceInfo(int argc, const char *argv[])
 }
 
 
-static void PrintFileList(const WCValOrderedVector<ToolboxFileEntry> &files)
+static void FormatFileSize(char *sizestr, size_t sizestrlen, unsigned long filesize)
+{
+    if (filesize < 1000) {
+        snprintf(sizestr, sizestrlen, "%ld B", filesize);
+    } else if (filesize < 1000000) {
+        snprintf(sizestr, sizestrlen, "%ld,%03ld B", filesize / 1000, filesize % 1000);
+    } else if (filesize < 1000000000) {
+        unsigned long M = filesize / 1000000;
+        unsigned long r = filesize % 1000000;
+        snprintf(sizestr, sizestrlen, "%ld,%03ld,%03ld B", M, r / 1000, r % 1000);
+    } else {
+        unsigned long M = filesize / 1000000;
+        unsigned long r = filesize % 1000000;
+        snprintf(sizestr, sizestrlen, "%ld,%03ld,%03ld,%03ld B", M / 1000, M % 1000, r / 1000, r % 1000);
+    }
+}
+
+static void PrintFileList(const FixedVector<ToolboxFileEntry> &files)
 {
     printf("%d files found\n", files.entries());
 
     for (size_t i = 0; i < files.entries(); i++) {
         const ToolboxFileEntry &tfe = files[i];
-        unsigned long filesize = tfe.GetSize();
         char sizestr[20];
-        if (filesize < 1000) {
-            snprintf(sizestr, sizeof(sizestr), "%ld B", filesize);
-        } else if (filesize < 1000000) {
-            snprintf(sizestr, sizeof(sizestr), "%ld,%03ld B", filesize / 1000, filesize % 1000);
-        } else if (filesize < 1000000000) {
-            unsigned long M = filesize / 1000000;
-            unsigned long r = filesize % 1000000;
-            snprintf(sizestr, sizeof(sizestr), "%ld,%03ld,%03ld B", M, r / 1000, r % 1000);
-        } else {
-            unsigned long M = filesize / 1000000;
-            unsigned long r = filesize % 1000000;
-            snprintf(sizestr, sizeof(sizestr), "%ld,%03ld,%03ld,%03ld B", M / 1000, M % 1000, r / 1000, r % 1000);
-        }
+        FormatFileSize(sizestr, sizeof(sizestr), tfe.GetSize());
         
         printf("%d %s%-32s %16s\n", tfe.index, tfe.type ? " " : "/", tfe.name, sizestr);
     }
 }
 
 
-static int FindFilenameInList(const WCValOrderedVector<ToolboxFileEntry> &files, const char *searchname)
+static int FindFilenameInList(const FixedVector<ToolboxFileEntry> &files, const char *searchname)
 {
     for (int i = 0; i < files.entries(); i++) {
         const ToolboxFileEntry &tfe = files[i];
@@ -174,6 +192,144 @@ static int FindFilenameInList(const WCValOrderedVector<ToolboxFileEntry> &files,
 }
 
 
+/* Find a file in the listing by index or by name */
+static const ToolboxFileEntry *FindSharedFile(const FixedVector<ToolboxFileEntry> &files, const char *arg)
+{
+    int fileindex = -1;
+
+    // Attempt to parse the file index to retrieve
+    if (sscanf(arg, "%d", &fileindex) != 1 || fileindex < 0 || fileindex >= files.entries()) {
+        // If failed, attempt to search for it as a filename
+        fileindex = FindFilenameInList(files, arg);
+    }
+
+    for (int i = 0; i < files.entries(); i++) {
+        if (files[i].index == fileindex) return &files[i];
+    }
+    return NULL;
+}
+
+
+/* Devices with media that can be changed, for which the firmware offers images */
+static bool IsImageDeviceType(int device_type)
+{
+    switch (device_type) {
+        case TOOLBOX_DEVTYPE_REMOVEABLE:
+        case TOOLBOX_DEVTYPE_OPTICAL:
+        case TOOLBOX_DEVTYPE_FLOPPY_14MB:
+        case TOOLBOX_DEVTYPE_MO:
+        case TOOLBOX_DEVTYPE_ZIP100:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Find the devices with toolbox support. The logical devices emulated by one
+ * physical device share their shared directory, so with one_per_physical set
+ * only the first of them is included. With image_devices set, only devices
+ * with removable media are included. */
+static bool FindToolboxDevices(FixedVector<const Device *> &devs, bool one_per_physical, bool image_devices = false)
+{
+    FixedVector<FoundToolboxDevice> tbdevs;
+    DeviceInquiryResult di;
+
+    if (!devs.reserve(_devices.entries()) || !tbdevs.reserve(_devices.entries())) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    for (int dev_id = 0; dev_id < _devices.entries(); dev_id++) {
+        const Device &dev = _devices[dev_id];
+        if (!DeviceInquiry(dev, &di) || !di.toolbox_flag) continue;
+
+        // The device list of the physical device tells which logical device this is
+        const FoundToolboxDevice *tbdev = NULL;
+        for (int i = 0; i < tbdevs.entries() && tbdev == NULL; i++) {
+            if (tbdevs[i].adapter_id == dev.adapter_id &&
+                tbdevs[i].tdl.device_type[dev.target_id] != TOOLBOX_DEVTYPE_NONE) {
+                tbdev = &tbdevs[i];
+            }
+        }
+        bool seen = tbdev != NULL;
+        if (tbdev == NULL) {
+            FoundToolboxDevice newtbdev;
+            if (ToolboxListDevices(dev, newtbdev.tdl)) {
+                newtbdev.adapter_id = dev.adapter_id;
+                if (tbdevs.append(newtbdev)) tbdev = &tbdevs.last();
+            }
+        }
+
+        if (one_per_physical && seen) continue;
+        if (image_devices && (tbdev == NULL || !IsImageDeviceType(tbdev->tdl.device_type[dev.target_id]))) continue;
+        devs.append(&dev);
+    }
+    return true;
+}
+
+static int CompareCatalogEntries(const void *a, const void *b)
+{
+    const CatalogEntry *x = (const CatalogEntry *)a;
+    const CatalogEntry *y = (const CatalogEntry *)b;
+    int r = stricmp(x->file.name, y->file.name);
+    if (r != 0) return r;
+    return strcmp(x->dev->name, y->dev->name);
+}
+
+/* List images or shared directory files of every toolbox device in one catalog, sorted by name */
+static int DoListCatalog(bool images)
+{
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    printf("Finding devices with toolbox support...\n");
+    FixedVector<const Device *> devs;
+    if (!FindToolboxDevices(devs, !images, images)) return 1;
+    if (devs.isEmpty()) {
+        fprintf(stderr, images ? "No toolbox devices with removable media found.\n" : "No devices with toolbox support found.\n");
+        return 17;
+    }
+
+    printf("Retrieving %s from %d devices...\n", images ? "images" : "file lists", devs.entries());
+    FixedVector<int> counts;
+    if (!counts.reserve(devs.entries())) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int total = ToolboxCountAll(devs, images, counts);
+
+    // The catalog can be larger than the arena, it is limited to one segment instead
+    const int MAX_CATALOG = 0xFFF0U / sizeof(CatalogEntry);
+    if (total > MAX_CATALOG) {
+        fprintf(stderr, "Only listing the first %d of %d files.\n", MAX_CATALOG, total);
+        total = MAX_CATALOG;
+    }
+    CatalogEntry *catalog = new CatalogEntry[total > 0 ? total : 1];
+    if (catalog == NULL) {
+        fprintf(stderr, "Out of memory for %d files\n", total);
+        return 1;
+    }
+    int entries = ToolboxListAll(devs, images, counts, catalog, total);
+    qsort(catalog, entries, sizeof(CatalogEntry), CompareCatalogEntries);
+
+    printf("%d files found\n", entries);
+    for (int i = 0; i < entries; i++) {
+        const CatalogEntry &ce = catalog[i];
+        char sizestr[20];
+        FormatFileSize(sizestr, sizeof(sizestr), ce.file.GetSize());
+        printf("%-7s %3d %s%-32s %16s\n", ce.dev->name, ce.file.index,
+            ce.file.type ? " " : "/", ce.file.name, sizestr);
+    }
+    delete[] catalog;
+
+    // Devices that could not be listed have already been reported
+    for (int i = 0; i < counts.entries(); i++) {
+        if (counts[i] < 0) return 17;
+    }
+    return 0;
+}
+
 static int DoListImages(int argc, const char *argv[])
 {
     int r = InitSCSI();
@@ -182,6 +338,8 @@ static int DoListImages(int argc, const char *argv[])
 
     if (r) return r;
 
+    if (stricmp(argv[0], "all") == 0) return DoListCatalog(true);
+
     const Device *dev = GetDeviceByName(argv[0]);
     if (!dev) {
         fprintf(stderr, "Device ID not found: %s\n", argv[0]);
@@ -191,7 +349,7 @@ static int DoListImages(int argc, const char *argv[])
     printf("Retrieving images from device %s type %d (%s)...\n",
         dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
 
-    WCValOrderedVector<ToolboxFileEntry> images;
+    FixedVector<ToolboxFileEntry> images;
     
     if (ToolboxGetImageList(*dev, images)) {
         PrintFileList(images);
@@ -202,15 +360,75 @@ static int DoListImages(int argc, const char *argv[])
 }
 
 
+/* Give up waiting for the new image after this long */
+static const unsigned int IMAGE_CHANGE_TIMEOUT_MS = 30000;
+
+/* Poll the device until it reports the medium changed, or becomes ready after
+ * having been not ready. The device only reports the change once, so polling
+ * takes the unit attention that a DOS CD-ROM driver would otherwise see. */
+static int WaitForImageChange(const Device &dev)
+{
+    const unsigned int FIRST_DELAY_MS = 10;
+    const unsigned int MAX_DELAY_MS = 250;
+    unsigned int delay_ms = FIRST_DELAY_MS;
+    unsigned long waited_ms;
+    bool seen_not_ready = false;
+    SENSE_DATA_FMT sense;
+
+    printf("Waiting for the new image...\n");
+    InitTimer();
+    // The commands take time as well, so measure from the start rather than
+    // adding up the delays
+    unsigned long start = ReadTimerTicks();
+    for (;;) {
+        int ready = DeviceTestUnitReady(dev, &sense);
+        if (ready < 0) return 1;
+        waited_ms = TimerTicksToMicroseconds(ReadTimerTicks() - start) / 1000;
+
+        if (ready > 0 && seen_not_ready) {
+            printf("Medium ready");
+            break;
+        }
+        if (ready == 0) {
+            unsigned char key = sense.SenseKey & 0x0F;
+            if (key == KEY_UNITATT && sense.AddSenseCode == 0x28) {
+                printf("Medium changed");
+                break;
+            }
+            if (key == KEY_NOTREADY) seen_not_ready = true;
+        }
+
+        if (waited_ms >= IMAGE_CHANGE_TIMEOUT_MS) {
+            fprintf(stderr, "The device did not report a medium change within %u seconds.\n",
+                IMAGE_CHANGE_TIMEOUT_MS / 1000);
+            return 20;
+        }
+        delay(delay_ms);
+        // Poll fast at first, the change often follows right away
+        if (delay_ms < MAX_DELAY_MS) delay_ms = delay_ms * 2 < MAX_DELAY_MS ? delay_ms * 2 : MAX_DELAY_MS;
+    }
+
+    printf(" after %lu ms\n", waited_ms);
+    return 0;
+}
+
 static int DoSetImage(int argc, const char *argv[])
 {
     int r = InitSCSI();
     int newimage = -1;
-
-    (void)argc; // unused parameter
+    bool wait = false;
 
     if (r) return r;
 
+    for (int argi = 2; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-w") == 0 || stricmp(argv[argi], "/w") == 0) {
+            wait = true;
+        } else {
+            fprintf(stderr, "Unknown setimg option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
     const Device *dev = GetDeviceByName(argv[0]);
     if (!dev) {
         fprintf(stderr, "Device ID not found: %s\n", argv[0]);
@@ -222,7 +440,7 @@ static int DoSetImage(int argc, const char *argv[])
         printf("Retrieving images from device %s type %d (%s)...\n",
             dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
 
-        WCValOrderedVector<ToolboxFileEntry> images;
+        FixedVector<ToolboxFileEntry> images;
 
         if (ToolboxGetImageList(*dev, images)) {
             newimage = FindFilenameInList(images, argv[1]);
@@ -240,8 +458,9 @@ static int DoSetImage(int argc, const char *argv[])
 
     r = ToolboxSetImage(*dev, newimage);
     if (r == 1) printf("Set next image command sent successfully.\n");
+    if (!r) return 1;
 
-    return r != 0;
+    return wait ? WaitForImageChange(*dev) : 0;
 }
 
 
@@ -253,6 +472,8 @@ static int DoListSharedDir(int argc, const char *argv[])
 
     if (r) return r;
 
+    if (stricmp(argv[0], "all") == 0) return DoListCatalog(false);
+
     const Device *dev = GetDeviceByName(argv[0]);
     if (!dev) {
         fprintf(stderr, "Device ID not found: %s\n", argv[0]);
@@ -262,7 +483,7 @@ static int DoListSharedDir(int argc, const char *argv[])
     printf("Retrieving file list from device %s type %d (%s)...\n",
         dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
 
-    WCValOrderedVector<ToolboxFileEntry> files;
+    FixedVector<ToolboxFileEntry> files;
     
     if (ToolboxGetSharedDirList(*dev, files)) {
         PrintFileList(files);
@@ -273,6 +494,13 @@ static int DoListSharedDir(int argc, const char *argv[])
 }
 
 
+/* basename may modify the path it is given, so it works on a copy in buf */
+static const char *CopyBaseName(char *buf, size_t bufsize, const char *path)
+{
+    snprintf(buf, bufsize, "%s", path);
+    return basename(buf);
+}
+
 static void CleanFileName(char *dstfn, const char *srcfn, int srclen)
 {
     int tmplen = strlen(srcfn);
@@ -320,215 +548,1957 @@ static void CleanFileName(char *dstfn, const char *srcfn, int srclen)
     // TODO: check for device name clashes? like CON, PRN, LPTx, COMx, AUX, NUL
 }
 
-static int DoGetSharedDirFile(int argc, const char *argv[])
+/* When a download is written to standard output, the file data gets its own
+ * handle for the original output, and standard output is pointed at standard
+ * error, so all messages and the progress display stay out of the data.
+ * Returns the data stream, or NULL on failure. */
+static FILE *RedirectStdoutForData(void)
 {
-    char outfn[128] = "";
-    int fileindex = -1;
-    int r = InitSCSI();
-
-    if (r) return r;
-
-    const Device *dev = GetDeviceByName(argv[0]);
-    if (!dev) {
-        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
-        return 16;
-    }
-
-    if (argc >= 3) {
-        strncpy(outfn, argv[2], sizeof(outfn));
-        printf("specified output filename: %s\n", outfn);
-    }
-
-    printf("Retrieving file list from device %s type %d (%s)...\n",
-        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
-
-    WCValOrderedVector<ToolboxFileEntry> files;
-    if (!ToolboxGetSharedDirList(*dev, files)) {
-        return 1;
+    fflush(stdout);
+    int datafd = dup(fileno(stdout));
+    if (datafd == -1) return NULL;
+    setmode(datafd, O_BINARY);
+    FILE *data = fdopen(datafd, "wb");
+    if (data == NULL) {
+        close(datafd);
+        return NULL;
     }
+    dup2(fileno(stderr), fileno(stdout));
+    return data;
+}
 
-    // Attempt to parse the file index to retrieve
-    if (sscanf(argv[1], "%d", &fileindex) != 1 || fileindex < 0 || fileindex >= files.entries()) {
-        // If failed, attempt to search for it as a filename
-        fileindex = FindFilenameInList(files, argv[1]);
-    }
+/* Close the data stream and point standard output back at it */
+static void RestoreStdoutFromData(FILE *data)
+{
+    fflush(stdout);
+    fflush(data);
+    dup2(fileno(data), fileno(stdout));
+    fclose(data);
+}
 
-    const ToolboxFileEntry *tfe = NULL;
-    for (int i = 0; i < files.entries(); i++) {
-        if (files[i].index == fileindex) {
-            tfe = &files[i];
-            break;
-        }
-    }
-    if (tfe == NULL) {
-        fprintf(stderr, "Illegal file index or name, please use one returned from the 'lsdir' command.\n");
-        return 17;
-    }
+/* Check whether a block contains only zero bytes, a machine word at a time */
+static bool IsZeroBlock(const unsigned char *buf, int len)
+{
+    const unsigned int *words = (const unsigned int *)buf;
+    int numwords = len / sizeof(unsigned int);
 
-    if (outfn[0] == '\0') {
-        CleanFileName(outfn, tfe->name, sizeof(tfe->name));
+    for (int i = 0; i < numwords; i++) {
+        if (words[i] != 0) return false;
     }
-
-    // Check if the destination file already exists
-    printf("Output file: %s\n", outfn);
-    FILE *outfile = fopen(outfn, "rb");
-    if (outfile != NULL) {
-        fclose(outfile);
-        outfile = NULL;
-        if (!AskForConfirmation("The output file already exists. Overwrite it?")) {
-            fprintf(stderr, "Not overwriting file, aborting.\n");
-            return 4;
-        }
+    for (int i = numwords * sizeof(unsigned int); i < len; i++) {
+        if (buf[i] != 0) return false;
     }
+    return true;
+}
 
-    // Actually open for writing
-    outfile = fopen(outfn, "wb");
-    if (outfile == NULL) {
-        fprintf(stderr, "Could not open output file for writing\n");
-        return 2;
-    }
+/* Check whether a path is on a network drive. The FAT file system does not
+ * clear the clusters it allocates when a file is extended by seeking past
+ * its end, so only a file server can be trusted to fill the gaps with zeros. */
+static bool IsRemotePath(const char *path)
+{
+    union REGS regs;
 
-    // TODO: check if destination volume has enough space for transfer first?
+    regs.w.ax = 0x4409; // IOCTL: check if block device is remote
+    regs.h.bl = (path[0] != '\0' && path[1] == ':') ? toupper(path[0]) - 'A' + 1 : 0;
+    intdos(&regs, &regs);
+    return !regs.w.cflag && (regs.w.dx & 0x1000) != 0;
+}
 
+/* With sparse set, blocks of only zeros are skipped over instead of written */
+static int DownloadSharedDirFile(const Device &dev, const ToolboxFileEntry &tfe, FILE *outfile, bool sparse)
+{
     // Protocol specifies that the block size is 4096 bytes.
     const int BLOCKSIZE = 4096;
-    unsigned long totalblocks = (tfe->GetSize() + (BLOCKSIZE - 1)) / BLOCKSIZE;
+    unsigned long totalblocks = (tfe.GetSize() + (BLOCKSIZE - 1)) / BLOCKSIZE;
     // Except the final block may be smaller according to the actual file size
     // retrieved from the folder listing.
-    int lastblocksize = (int)(tfe->GetSize() % BLOCKSIZE);
+    int lastblocksize = (int)(tfe.GetSize() % BLOCKSIZE);
     if (lastblocksize == 0) lastblocksize  = BLOCKSIZE;
     // Prepare to do actual transfer.
     unsigned char *databuf = new unsigned char[BLOCKSIZE];
     unsigned long totaltransferred = 0;
+    unsigned long crc = 0;
+    unsigned long skipped = 0;
+    bool last_skipped = false;
+    Progress progress;
+    ProgressBegin(progress, tfe.GetSize());
     for (unsigned long block = 0; block < totalblocks; block++) {
-        printf("  Block %ld / %ld (%d%%)...\r", block+1, totalblocks, (block + 1) * 100 / totalblocks);
         int bufsize = block == (totalblocks - 1) ? lastblocksize : BLOCKSIZE;
-        int r = ToolboxGetFileBlock(*dev, fileindex, block, databuf, bufsize);
+        int r = ToolboxGetFileBlock(dev, tfe.index, block, databuf, bufsize);
         bool error = r < 0;
         if (r == 0) {
             fprintf(stderr,
-                "Unexpected zero byte transfer.                                       \n"
+                "\nUnexpected zero byte transfer.\n"
                 "If this occurs consistently, please file a bug report to the project.\n"
                 );
         }
         if (!error) {
-            error = fwrite(databuf, r, 1, outfile) != 1;
+            last_skipped = sparse && r > 0 && IsZeroBlock(databuf, r);
+            if (last_skipped) {
+                error = fseek(outfile, r, SEEK_CUR) != 0;
+                skipped++;
+            } else {
+                error = fwrite(databuf, r, 1, outfile) != 1;
+            }
             if (error) {
-                fprintf(stderr, "Error writing to output file.                  \n");
+                fprintf(stderr, "\nError writing to output file.\n");
             } else {
                 totaltransferred += r;
+                crc = Crc32Update(crc, databuf, r);
+                ProgressUpdate(progress, totaltransferred);
             }
         }
         if (error) {
-            fprintf(stderr, "Aborting transfer...                   \n");
-            ToolboxGetFileBlock(*dev, fileindex, totalblocks-1, databuf, lastblocksize);
+            fprintf(stderr, "\nAborting transfer...\n");
+            ToolboxGetFileBlock(dev, tfe.index, totalblocks-1, databuf, lastblocksize);
             delete[] databuf;
             return 3;
         }
     }
 
+    // If the file ends in skipped blocks, writing the final byte sets the length
+    if (last_skipped && (fseek(outfile, -1, SEEK_CUR) != 0 || fputc(0, outfile) == EOF)) {
+        fprintf(stderr, "\nError writing to output file.\n");
+        delete[] databuf;
+        return 3;
+    }
+
+    ProgressEnd(progress);
+    printf("  Received %lu bytes, CRC32 %08lX\n", totaltransferred, crc);
+    if (sparse) printf("  Skipped %lu blocks of zeros\n", skipped);
+
     delete[] databuf;
-    fclose(outfile);
+    if (fflush(outfile) != 0) {
+        fprintf(stderr, "Error writing to output file.\n");
+        return 3;
+    }
     return 0;
 }
 
-static int DoPutSharedDirFile(int argc, const char *argv[])
+static unsigned long RoundUpToClusters(unsigned long size, unsigned long cluster_bytes)
 {
-    int r = InitSCSI();
+    unsigned long clusters = size / cluster_bytes + (size % cluster_bytes != 0);
+    return clusters > 0xFFFFFFFFUL / cluster_bytes ? 0xFFFFFFFFUL : clusters * cluster_bytes;
+}
 
-    (void)argc; // unused parameter
+/* Make sure the file fits on the destination drive before starting, counting
+ * the space of an existing file that is going to be overwritten */
+static int CheckFreeSpace(const char *outfn, unsigned long size)
+{
+    struct diskfree_t df;
+    struct stat st;
+
+    unsigned drive = (outfn[0] != '\0' && outfn[1] == ':') ? toupper(outfn[0]) - 'A' + 1 : 0;
+    // If the free space can not be found, the transfer is tried anyway
+    if (_dos_getdiskfree(drive, &df) != 0) return 0;
+
+    unsigned long cluster_bytes = (unsigned long)df.sectors_per_cluster * df.bytes_per_sector;
+    if (cluster_bytes == 0) return 0;
+    unsigned long free_bytes = df.avail_clusters > 0xFFFFFFFFUL / cluster_bytes ?
+        0xFFFFFFFFUL : (unsigned long)df.avail_clusters * cluster_bytes;
+    if (stat(outfn, &st) == 0) {
+        unsigned long existing = RoundUpToClusters((unsigned long)st.st_size, cluster_bytes);
+        free_bytes = free_bytes > 0xFFFFFFFFUL - existing ? 0xFFFFFFFFUL : free_bytes + existing;
+    }
+
+    unsigned long needed = RoundUpToClusters(size, cluster_bytes);
+    if (needed > free_bytes) {
+        fprintf(stderr, "Not enough free space on the destination drive, %lu kB needed but only %lu kB free.\n",
+            needed / 1024, free_bytes / 1024);
+        return 5;
+    }
+    return 0;
+}
 
+/* Set the file length by writing zero bytes at the given position. Growing
+ * a file this way allocates all the clusters in one go, without writing
+ * any data, which keeps the file in one piece on FAT drives. */
+static bool SetFileLength(FILE *f, unsigned long length)
+{
+    unsigned written;
+    int fd = fileno(f);
+
+    if (fflush(f) != 0) return false;
+    if (lseek(fd, length, SEEK_SET) == -1L) return false;
+    bool ok = _dos_write(fd, "", 0, &written) == 0;
+    // Let the stream know about the position change
+    return fseek(f, 0, SEEK_SET) == 0 && ok;
+}
+
+static int DownloadSharedDirFile(const Device &dev, const ToolboxFileEntry &tfe, const char *outfn, bool sparse = false)
+{
+    if (tfe.size[0] != 0) {
+        fprintf(stderr, "The file is larger than 4 GB, and can not be stored on a DOS drive.\n");
+        return 5;
+    }
+    int r = CheckFreeSpace(outfn, tfe.GetSize());
     if (r) return r;
 
-    const Device *dev = GetDeviceByName(argv[0]);
-    if (!dev) {
-        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
-        return 16;
+    FILE *outfile = fopen(outfn, "wb");
+    if (outfile == NULL) {
+        fprintf(stderr, "Could not open output file for writing\n");
+        return 2;
     }
 
-    printf("Verifying destination device %s type %d (%s)...\n",
-        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
+    // Sparse files are left to the file server, preallocating would fill them in
+    bool preallocated = !sparse && tfe.GetSize() > 0 && SetFileLength(outfile, tfe.GetSize());
 
-    WCValOrderedVector<ToolboxFileEntry> files;
-    if (!ToolboxGetSharedDirList(*dev, files)) {
-        return 17;
+    r = DownloadSharedDirFile(dev, tfe, outfile, sparse);
+    if (r && preallocated) {
+        // Do not leave the unwritten rest of the file looking like valid data
+        long written = ftell(outfile);
+        if (written >= 0) SetFileLength(outfile, (unsigned long)written);
     }
+    fclose(outfile);
+    return r;
+}
 
-    const char *inpfn = argv[1];
-    const char *outfn = basename(strdup(inpfn)); // assume DOS will clean up the memory on exit
+static int DoGetSharedDirFileToStream(const Device &dev, const char *filearg, FILE *outfile)
+{
+    printf("Retrieving file list from device %s type %d (%s)...\n",
+        dev.name, dev.devtype, GetDeviceTypeName(dev.devtype));
 
-    int infile = _open(inpfn, O_RDONLY | O_BINARY);
-    if (infile == -1) {
-        fprintf(stderr, "The source file could not be opened for reading.\n");
+    FixedVector<ToolboxFileEntry> files;
+    if (!ToolboxGetSharedDirList(dev, files)) {
         return 1;
     }
-    long filesize = _filelength(infile);
 
-    for (int i = 0; i < files.entries(); i++)  {
-        if (stricmp(outfn, files[i].name) == 0) {
-            fprintf(stderr, "Destination filename: %s\n", outfn);
-            if (!AskForConfirmation("The destination already contains a file with this name. Overwrite?")) {
-                _close(infile);
-                return 2;
-            }
-        }
+    const ToolboxFileEntry *tfe = FindSharedFile(files, filearg);
+    if (tfe == NULL) {
+        fprintf(stderr, "Illegal file index or name, please use one returned from the 'lsdir' command.\n");
+        return 17;
     }
 
-    if (!ToolboxSendFileBegin(*dev, outfn)) {
-        _close(infile);
-        return 18;
-    }
+    printf("Output to standard output\n");
+    return DownloadSharedDirFile(dev, *tfe, outfile, false);
+}
 
-    const unsigned short BUFSIZE = 512;
-    char *buf = new char[BUFSIZE];
-    unsigned long block_index = 0;
-    unsigned long num_blocks = ((unsigned long)filesize + (BUFSIZE - 1)) / BUFSIZE;
-    int error_status = 0;
+static int DoGetSharedDirFile(int argc, const char *argv[])
+{
+    char outfn[128] = "";
+    int r = InitSCSI();
 
-    printf("Sending: %s => %s\n", inpfn, outfn);
+    if (r) return r;
 
-    while (block_index < num_blocks) {
-        short data_size = _read(infile, buf, BUFSIZE);
-        if (data_size > 0) {
-            if (!ToolboxSendFileBlock(*dev, data_size, block_index, buf)) {
-                error_status = 18;
-                break;
-            }
-        } else if (data_size < 0) {
-            fprintf(stderr, "Error reading file, aborting transfer.\n");
-            error_status = 3;
-            break;
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    const char *outarg = NULL;
+    bool sparse = false;
+    for (int argi = 2; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-s") == 0 || stricmp(argv[argi], "/s") == 0) {
+            sparse = true;
+        } else if (outarg == NULL) {
+            outarg = argv[argi];
+        } else {
+            fprintf(stderr, "Unknown get option: %s\n", argv[argi]);
+            return 9;
         }
-        printf("  Block %lu / %lu (%d%%)...\r", block_index+1, num_blocks, (block_index + 1) * 100 / num_blocks);
-        block_index++;
-        if (data_size < BUFSIZE) break;
     }
-    printf("  Finished sending %lu blocks            \n", num_blocks);
-    delete[] buf;
 
-    if (!error_status && !ToolboxSendFileEnd(*dev)) {
-        error_status = 19;
+    if (outarg != NULL && strcmp(outarg, "-") == 0) {
+        if (sparse) {
+            fprintf(stderr, "Sparse output is not possible to standard output\n");
+            return 9;
+        }
+        FILE *data = RedirectStdoutForData();
+        if (data == NULL) {
+            fprintf(stderr, "Could not open standard output for writing\n");
+            return 2;
+        }
+        r = DoGetSharedDirFileToStream(*dev, argv[1], data);
+        RestoreStdoutFromData(data);
+        return r;
     }
 
-    if (error_status) {
-        fprintf(stderr, "An error occurred during the transfer, the destination file may have errors.\n");
+    if (outarg != NULL) {
+        strncpy(outfn, outarg, sizeof(outfn));
+        printf("specified output filename: %s\n", outfn);
     }
 
-    _close(infile);
+    printf("Retrieving file list from device %s type %d (%s)...\n",
+        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
 
-    return error_status;
-}
+    FixedVector<ToolboxFileEntry> files;
+    if (!ToolboxGetSharedDirList(*dev, files)) {
+        return 1;
+    }
 
-static int DoDebugFlag(int argc, const char *argv[])
-{
-    bool perform_set = false;
-    bool new_flag = false;
-    if (argc >= 2) {
-        perform_set = true;
-        switch (argv[1][0]) {
-            case '1':
-            case 'y':
-            case 't':
+    const ToolboxFileEntry *tfe = FindSharedFile(files, argv[1]);
+    if (tfe == NULL) {
+        fprintf(stderr, "Illegal file index or name, please use one returned from the 'lsdir' command.\n");
+        return 17;
+    }
+
+    if (outfn[0] == '\0') {
+        CleanFileName(outfn, tfe->name, sizeof(tfe->name));
+    }
+
+    // Check if the destination file already exists
+    printf("Output file: %s\n", outfn);
+    FILE *outfile = fopen(outfn, "rb");
+    if (outfile != NULL) {
+        fclose(outfile);
+        outfile = NULL;
+        if (!AskForConfirmation("The output file already exists. Overwrite it?")) {
+            fprintf(stderr, "Not overwriting file, aborting.\n");
+            return 4;
+        }
+    }
+
+    if (sparse && !IsRemotePath(outfn)) {
+        printf("Sparse output needs a network drive, writing all blocks.\n");
+        sparse = false;
+    }
+
+    return DownloadSharedDirFile(*dev, *tfe, outfn, sparse);
+}
+
+/* Read until the buffer is full or the end of the file, pipes and devices
+ * can return less than asked for before the end */
+static int ReadFull(int fd, char *buf, int size)
+{
+    int total = 0;
+    while (total < size) {
+        int r = _read(fd, buf + total, size - total);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        total += r;
+    }
+    return total;
+}
+
+static bool SharedFileHasSize(const Device &dev, const char *filename, unsigned long size)
+{
+    FixedVector<ToolboxFileEntry> files;
+    if (!ToolboxGetSharedDirList(dev, files)) return false;
+
+    for (int i = 0; i < files.entries(); i++) {
+        if (stricmp(files[i].name, filename) == 0) {
+            return files[i].size[0] == 0 && files[i].GetSize() == size;
+        }
+    }
+    return false;
+}
+
+/* Open a file to upload, or standard input with "-", where the size is then not known in advance */
+static int OpenUploadSource(const char *&inpfn, unsigned long &filesize)
+{
+    int infile;
+    filesize = 0;
+    if (strcmp(inpfn, "-") == 0) {
+        infile = fileno(stdin);
+        setmode(infile, O_BINARY);
+        inpfn = "(standard input)";
+    } else {
+        infile = _open(inpfn, O_RDONLY | O_BINARY);
+        if (infile == -1) {
+            fprintf(stderr, "The source file could not be opened for reading.\n");
+            return -1;
+        }
+        filesize = (unsigned long)_filelength(infile);
+    }
+    return infile;
+}
+
+/* With skip_zeros set, full blocks of only zeros are not sent, leaving a gap
+ * the device firmware fills when it writes the next block */
+static int UploadSharedDirFile(const Device &dev, const char *inpfn, const char *outfn, bool skip_zeros = false)
+{
+    bool from_stdin = strcmp(inpfn, "-") == 0;
+    unsigned long filesize;
+    int infile = OpenUploadSource(inpfn, filesize);
+    if (infile == -1) return 1;
+
+    if (!ToolboxSendFileBegin(dev, outfn)) {
+        if (!from_stdin) _close(infile);
+        return 18;
+    }
+
+    const unsigned short BUFSIZE = 512;
+    char *buf = new char[BUFSIZE];
+    unsigned long block_index = 0;
+    unsigned long bytes_sent = 0;
+    unsigned long crc = 0;
+    unsigned long skipped = 0;
+    bool last_skipped = false;
+    int error_status = 0;
+
+    printf("Sending: %s => %s\n", inpfn, outfn);
+
+    Progress progress;
+    ProgressBegin(progress, filesize);
+    for (;;) {
+        // Every block but the last must be full, since blocks are placed by index
+        int data_size = ReadFull(infile, buf, BUFSIZE);
+        if (data_size < 0) {
+            fprintf(stderr, "Error reading file, aborting transfer.\n");
+            error_status = 3;
+            break;
+        }
+        if (data_size == 0) break;
+        if (block_index >> 24 > 0) {
+            fprintf(stderr, "File is too large, aborting transfer.\n");
+            error_status = 3;
+            break;
+        }
+        last_skipped = skip_zeros && data_size == BUFSIZE && IsZeroBlock((unsigned char *)buf, data_size);
+        if (last_skipped) {
+            skipped++;
+        } else if (!ToolboxSendFileBlock(dev, data_size, block_index, buf)) {
+            error_status = 18;
+            break;
+        }
+        crc = Crc32Update(crc, (unsigned char *)buf, data_size);
+        block_index++;
+        bytes_sent += data_size;
+        ProgressUpdate(progress, bytes_sent);
+        if (data_size < BUFSIZE) break;
+    }
+    // The last block is always sent, so the file gets its full length
+    if (!error_status && last_skipped) {
+        memset(buf, 0, BUFSIZE);
+        skipped--;
+        if (!ToolboxSendFileBlock(dev, BUFSIZE, block_index - 1, buf)) {
+            error_status = 18;
+        }
+    }
+    ProgressEnd(progress);
+    printf("  Finished sending %lu blocks, CRC32 %08lX\n", block_index, crc);
+    if (skip_zeros) printf("  Skipped %lu blocks of zeros\n", skipped);
+    delete[] buf;
+
+    if (!error_status && !ToolboxSendFileEnd(dev)) {
+        error_status = 19;
+    }
+
+    // Skipped blocks rely on the firmware filling gaps, check it at least got the size right
+    if (!error_status && skipped > 0 && !SharedFileHasSize(dev, outfn, bytes_sent)) {
+        fprintf(stderr, "The file size on the device does not match, the firmware may not support skipped blocks.\n");
+        error_status = 19;
+    }
+
+    if (error_status) {
+        fprintf(stderr, "An error occurred during the transfer, the destination file may have errors.\n");
+    }
+
+    if (!from_stdin) _close(infile);
+
+    return error_status;
+}
+
+/* Upload one file to several devices, reading each block of the source once
+ * and sending it to all devices before the next. A device that fails is left
+ * out of the rest of the transfer, while the others continue. */
+static int UploadSharedDirFileToAll(const FixedVector<const Device *> &devs, const char *inpfn,
+    const char *outfn, bool skip_zeros)
+{
+    bool from_stdin = strcmp(inpfn, "-") == 0;
+    unsigned long filesize;
+    int infile = OpenUploadSource(inpfn, filesize);
+    if (infile == -1) return 1;
+
+    FixedVector<int> status;
+    if (!status.reserve(devs.entries())) {
+        fprintf(stderr, "Out of memory\n");
+        if (!from_stdin) _close(infile);
+        return 1;
+    }
+    int active = 0;
+    for (int i = 0; i < devs.entries(); i++) {
+        bool ok = ToolboxSendFileBegin(*devs[i], outfn);
+        status.append(ok ? 0 : 18);
+        if (ok) active++;
+    }
+
+    const unsigned short BUFSIZE = 512;
+    char *buf = new char[BUFSIZE];
+    unsigned long block_index = 0;
+    unsigned long bytes_sent = 0;
+    unsigned long crc = 0;
+    unsigned long skipped = 0;
+    bool last_skipped = false;
+
+    printf("Sending: %s => %s on %d devices\n", inpfn, outfn, active);
+
+    Progress progress;
+    ProgressBegin(progress, filesize);
+    while (active > 0) {
+        int data_size = ReadFull(infile, buf, BUFSIZE);
+        if (data_size < 0 || block_index >> 24 > 0) {
+            fprintf(stderr, data_size < 0 ? "Error reading file, aborting transfer.\n" :
+                "File is too large, aborting transfer.\n");
+            for (int i = 0; i < status.entries(); i++) {
+                if (status[i] == 0) status[i] = 3;
+            }
+            break;
+        }
+        if (data_size == 0) break;
+        last_skipped = skip_zeros && data_size == BUFSIZE && IsZeroBlock((unsigned char *)buf, data_size);
+        if (last_skipped) {
+            skipped++;
+        } else {
+            ToolboxSendFileBlockAll(devs, status, data_size, block_index, buf);
+        }
+        crc = Crc32Update(crc, (unsigned char *)buf, data_size);
+        block_index++;
+        bytes_sent += data_size;
+        ProgressUpdate(progress, bytes_sent);
+        if (data_size < BUFSIZE) break;
+
+        active = 0;
+        for (int i = 0; i < status.entries(); i++) {
+            if (status[i] == 0) active++;
+        }
+    }
+    // The last block is always sent, so the file gets its full length
+    if (last_skipped) {
+        memset(buf, 0, BUFSIZE);
+        skipped--;
+        ToolboxSendFileBlockAll(devs, status, BUFSIZE, block_index - 1, buf);
+    }
+    ProgressEnd(progress);
+    printf("  Finished sending %lu blocks, CRC32 %08lX\n", block_index, crc);
+    if (skip_zeros) printf("  Skipped %lu blocks of zeros\n", skipped);
+    delete[] buf;
+    if (!from_stdin) _close(infile);
+
+    int error_status = 0;
+    for (int i = 0; i < devs.entries(); i++) {
+        const Device &dev = *devs[i];
+        if (status[i] == 0 && !ToolboxSendFileEnd(dev)) status[i] = 19;
+        if (status[i] == 0 && skipped > 0 && !SharedFileHasSize(dev, outfn, bytes_sent)) {
+            fprintf(stderr, "[%s] The file size on the device does not match.\n", dev.name);
+            status[i] = 19;
+        }
+        if (status[i] == 0) {
+            printf("  %-7s OK\n", dev.name);
+        } else {
+            printf("  %-7s failed, the destination file may have errors\n", dev.name);
+            if (!error_status) error_status = status[i];
+        }
+    }
+    return error_status;
+}
+
+/* Find the devices in a list like "0,1,1:2" */
+static bool GetDeviceList(const char *arg, FixedVector<const Device *> &devs)
+{
+    char name[16];
+
+    if (!devs.reserve(_devices.entries())) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    while (*arg != '\0') {
+        size_t len = strcspn(arg, ",");
+        if (len >= sizeof(name)) len = sizeof(name) - 1;
+        strncpy(name, arg, len);
+        name[len] = '\0';
+        arg += strcspn(arg, ",");
+        if (*arg == ',') arg++;
+
+        const Device *dev = GetDeviceByName(name);
+        if (!dev) {
+            fprintf(stderr, "Device ID not found: %s\n", name);
+            return false;
+        }
+        if (!devs.append(dev)) {
+            fprintf(stderr, "Too many devices in list\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Put to "all" toolbox devices, or a comma separated list of devices */
+static int DoPutSharedDirFileToAll(const char *devarg, const char *inpfn, const char *outfn,
+    bool from_stdin, bool skip_zeros)
+{
+    FixedVector<const Device *> devs;
+    if (stricmp(devarg, "all") == 0) {
+        printf("Finding devices with toolbox support...\n");
+        if (!FindToolboxDevices(devs, true)) return 1;
+    } else if (!GetDeviceList(devarg, devs)) {
+        return 16;
+    }
+    if (devs.isEmpty()) {
+        fprintf(stderr, "No devices with toolbox support found.\n");
+        return 16;
+    }
+
+    int existing = 0;
+    for (int d = 0; d < devs.entries(); d++) {
+        const Device &dev = *devs[d];
+        printf("Verifying destination device %s type %d (%s)...\n",
+            dev.name, dev.devtype, GetDeviceTypeName(dev.devtype));
+
+        FixedVector<ToolboxFileEntry> files;
+        if (!ToolboxGetSharedDirList(dev, files)) {
+            return 17;
+        }
+        for (int i = 0; i < files.entries(); i++) {
+            if (stricmp(outfn, files[i].name) == 0) existing++;
+        }
+    }
+
+    if (existing > 0) {
+        fprintf(stderr, "Destination filename: %s\n", outfn);
+        if (from_stdin) {
+            fprintf(stderr, "The destination already contains a file with this name, not overwriting.\n");
+            return 2;
+        }
+        if (!AskForConfirmation("Some destinations already contain a file with this name. Overwrite?")) {
+            return 2;
+        }
+        if (skip_zeros) {
+            printf("Not skipping zero blocks when overwriting a file.\n");
+            skip_zeros = false;
+        }
+    }
+
+    return UploadSharedDirFileToAll(devs, inpfn, outfn, skip_zeros);
+}
+
+static int DoPutSharedDirFile(int argc, const char *argv[])
+{
+    const char *inpfn = argv[1];
+    bool from_stdin = strcmp(inpfn, "-") == 0;
+    const char *outarg = NULL;
+    bool skip_zeros = false;
+
+    for (int argi = 2; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-z") == 0 || stricmp(argv[argi], "/z") == 0) {
+            skip_zeros = true;
+        } else if (outarg == NULL) {
+            outarg = argv[argi];
+        } else {
+            fprintf(stderr, "Unknown put option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+    if (from_stdin && outarg == NULL) {
+        fprintf(stderr, "A destination filename is needed when sending from standard input\n");
+        return 9;
+    }
+
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    char basebuf[_MAX_PATH];
+    const char *outfn = outarg ? outarg : CopyBaseName(basebuf, sizeof(basebuf), inpfn);
+
+    if (stricmp(argv[0], "all") == 0 || strchr(argv[0], ',') != NULL) {
+        return DoPutSharedDirFileToAll(argv[0], inpfn, outfn, from_stdin, skip_zeros);
+    }
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    printf("Verifying destination device %s type %d (%s)...\n",
+        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
+
+    FixedVector<ToolboxFileEntry> files;
+    if (!ToolboxGetSharedDirList(*dev, files)) {
+        return 17;
+    }
+
+    for (int i = 0; i < files.entries(); i++)  {
+        if (stricmp(outfn, files[i].name) == 0) {
+            fprintf(stderr, "Destination filename: %s\n", outfn);
+            // Standard input holds the file data, so there is no one to ask
+            if (from_stdin) {
+                fprintf(stderr, "The destination already contains a file with this name, not overwriting.\n");
+                return 2;
+            }
+            if (!AskForConfirmation("The destination already contains a file with this name. Overwrite?")) {
+                return 2;
+            }
+            // The skipped blocks could keep the old file's data
+            if (skip_zeros) {
+                printf("Not skipping zero blocks when overwriting a file.\n");
+                skip_zeros = false;
+            }
+        }
+    }
+
+    return UploadSharedDirFile(*dev, inpfn, outfn, skip_zeros);
+}
+
+
+static int CopySharedDirFile(const Device &srcdev, const ToolboxFileEntry &tfe, const Device &dstdev, const char *outfn)
+{
+    // Files are read in 4096 byte blocks, and sent in 512 byte blocks
+    const int BLOCKSIZE = 4096;
+    const int SENDSIZE = 512;
+    unsigned long totalblocks = (tfe.GetSize() + (BLOCKSIZE - 1)) / BLOCKSIZE;
+    int lastblocksize = (int)(tfe.GetSize() % BLOCKSIZE);
+    if (lastblocksize == 0) lastblocksize = BLOCKSIZE;
+
+    // With the devices on different adapters, the next block is read while
+    // the current one is sent. The block being read lands in the command's own
+    // buffer, so together with databuf the data is double buffered.
+    // On the same adapter the commands would only wait for each other.
+    bool overlap = srcdev.adapter_id != dstdev.adapter_id;
+
+    if (!ToolboxSendFileBegin(dstdev, outfn)) return 18;
+
+    unsigned char *databuf = new unsigned char[BLOCKSIZE];
+    unsigned long totaltransferred = 0;
+    unsigned long send_index = 0;
+    unsigned long crc = 0;
+    int error_status = 0;
+    ScsiCommand *pending = NULL;
+
+    if (overlap && totalblocks > 0) {
+        pending = ToolboxGetFileBlockStart(srcdev, tfe.index, 0, totalblocks == 1 ? lastblocksize : BLOCKSIZE);
+    }
+
+    Progress progress;
+    ProgressBegin(progress, tfe.GetSize());
+    for (unsigned long block = 0; block < totalblocks && !error_status; block++) {
+        int bufsize = block == (totalblocks - 1) ? lastblocksize : BLOCKSIZE;
+        int r;
+        if (overlap) {
+            r = ToolboxGetFileBlockFinish(srcdev, pending, databuf, bufsize);
+            pending = NULL;
+            if (r > 0 && block + 1 < totalblocks) {
+                int nextsize = block + 1 == (totalblocks - 1) ? lastblocksize : BLOCKSIZE;
+                pending = ToolboxGetFileBlockStart(srcdev, tfe.index, block + 1, nextsize);
+            }
+        } else {
+            r = ToolboxGetFileBlock(srcdev, tfe.index, block, databuf, bufsize);
+        }
+        if (r <= 0) {
+            error_status = 3;
+            break;
+        }
+        crc = Crc32Update(crc, databuf, r);
+
+        for (int offset = 0; offset < r; offset += SENDSIZE) {
+            unsigned short data_size = r - offset < SENDSIZE ? r - offset : SENDSIZE;
+            if (!ToolboxSendFileBlock(dstdev, data_size, send_index++, (const char *)databuf + offset)) {
+                error_status = 18;
+                break;
+            }
+        }
+        totaltransferred += r;
+        ProgressUpdate(progress, totaltransferred);
+    }
+
+    // The data of a read still in flight is not used, it only has to complete
+    // before its buffer can be given back
+    if (pending != NULL) {
+        pending->Wait();
+        pending->Release();
+    }
+    if (error_status) {
+        // Reading the final block lets the source device close the file
+        fprintf(stderr, "\nAborting transfer...\n");
+        ToolboxGetFileBlock(srcdev, tfe.index, totalblocks - 1, databuf, lastblocksize);
+    }
+    ProgressEnd(progress);
+    delete[] databuf;
+
+    if (!error_status) {
+        printf("  Copied %lu bytes, CRC32 %08lX\n", totaltransferred, crc);
+        if (!ToolboxSendFileEnd(dstdev)) error_status = 19;
+    }
+    if (error_status) {
+        fprintf(stderr, "An error occurred during the transfer, the destination file may have errors.\n");
+    }
+
+    return error_status;
+}
+
+static int DoCopySharedDirFile(int argc, const char *argv[])
+{
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    const Device *srcdev = GetDeviceByName(argv[0]);
+    if (!srcdev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+    const Device *dstdev = GetDeviceByName(argv[2]);
+    if (!dstdev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[2]);
+        return 16;
+    }
+    if (srcdev == dstdev) {
+        fprintf(stderr, "The source and destination must be different devices.\n");
+        return 9;
+    }
+
+    printf("Retrieving file list from device %s type %d (%s)...\n",
+        srcdev->name, srcdev->devtype, GetDeviceTypeName(srcdev->devtype));
+
+    FixedVector<ToolboxFileEntry> srcfiles;
+    if (!ToolboxGetSharedDirList(*srcdev, srcfiles)) {
+        return 17;
+    }
+
+    const ToolboxFileEntry *tfe = FindSharedFile(srcfiles, argv[1]);
+    if (tfe == NULL) {
+        fprintf(stderr, "Illegal file index or name, please use one returned from the 'lsdir' command.\n");
+        return 17;
+    }
+    if (tfe->size[0] != 0) {
+        fprintf(stderr, "Files larger than 4 GB can not be copied.\n");
+        return 17;
+    }
+    const char *outfn = argc >= 4 ? argv[3] : tfe->name;
+
+    printf("Verifying destination device %s type %d (%s)...\n",
+        dstdev->name, dstdev->devtype, GetDeviceTypeName(dstdev->devtype));
+
+    FixedVector<ToolboxFileEntry> dstfiles;
+    if (!ToolboxGetSharedDirList(*dstdev, dstfiles)) {
+        return 17;
+    }
+    for (int i = 0; i < dstfiles.entries(); i++)  {
+        if (stricmp(outfn, dstfiles[i].name) == 0) {
+            fprintf(stderr, "Destination filename: %s\n", outfn);
+            if (!AskForConfirmation("The destination already contains a file with this name. Overwrite?")) {
+                return 2;
+            }
+        }
+    }
+
+    printf("Copying: %s:%s => %s:%s\n", srcdev->name, tfe->name, dstdev->name, outfn);
+    return CopySharedDirFile(*srcdev, *tfe, *dstdev, outfn);
+}
+
+
+/* Reads larger than this would need command buffers near the 64 kB segment limit */
+static const unsigned int IMAGE_MAX_TRANSFER = 0x7FFF;
+/* Number of reads kept queued at the adapter, besides the one being written out */
+static const int IMAGE_READ_AHEAD = 2;
+
+/* Number of blocks to move in one READ10 or WRITE10, limited by the adapter */
+static unsigned short ImageBlocksPerTransfer(const Device &dev, unsigned long blocksize)
+{
+    unsigned long maxbytes = _adapters[dev.adapter_id].max_transfer_length;
+    if (maxbytes > IMAGE_MAX_TRANSFER) maxbytes = IMAGE_MAX_TRANSFER;
+    unsigned long count = maxbytes / blocksize;
+    return count > 0 ? (unsigned short)count : 1;
+}
+
+/* Get the size of the medium, and check it can be transferred in whole blocks.
+ * With image_file set, also check the medium fits in an image file. */
+static bool GetImageGeometry(const Device &dev, unsigned long &blocks, unsigned long &blocksize, bool image_file = true)
+{
+    printf("Reading capacity of device %s type %d (%s)...\n",
+        dev.name, dev.devtype, GetDeviceTypeName(dev.devtype));
+
+    if (!DeviceReadCapacity(dev, blocks, blocksize)) {
+        fprintf(stderr, "Could not read the capacity, is there a medium in the device?\n");
+        return false;
+    }
+    if (blocksize == 0 || blocksize > IMAGE_MAX_TRANSFER) {
+        fprintf(stderr, "Unsupported block size %lu bytes.\n", blocksize);
+        return false;
+    }
+    if (image_file && blocks > 0xFFFFFFFFUL / blocksize) {
+        fprintf(stderr, "The medium is larger than 4 GB, and can not be stored on a DOS drive.\n");
+        return false;
+    }
+
+    printf("  %lu blocks of %lu bytes, %lu kB\n", blocks, blocksize,
+        blocks / 1024 * blocksize + blocks % 1024 * blocksize / 1024);
+    return true;
+}
+
+/* Reads sent to the device and not yet written out, oldest first */
+struct ImageReadQueue {
+    ScsiCommand *cmd[IMAGE_READ_AHEAD];
+    unsigned int len[IMAGE_READ_AHEAD];
+    int entries;
+    unsigned long next_lba;
+};
+
+static bool FillImageReadQueue(const Device &dev, ImageReadQueue &q,
+    unsigned long blocks, unsigned long blocksize, unsigned short per_transfer)
+{
+    while (q.entries < IMAGE_READ_AHEAD && q.next_lba < blocks) {
+        unsigned short count = blocks - q.next_lba < per_transfer ? (unsigned short)(blocks - q.next_lba) : per_transfer;
+        ScsiCommand *cmd = DeviceReadBlocksStart(dev, q.next_lba, count, (int)(count * blocksize));
+        if (cmd == NULL) return false;
+        q.cmd[q.entries] = cmd;
+        q.len[q.entries] = (unsigned int)(count * blocksize);
+        q.entries++;
+        q.next_lba += count;
+    }
+    return true;
+}
+
+/* The medium is read in transfers as large as the adapter allows. Several reads
+ * are queued at once, and each finished one is written to the file while the
+ * following reads run, so the bus and the local disk are kept busy together. */
+static int ReadImage(const Device &dev, unsigned long blocks, unsigned long blocksize, FILE *outfile)
+{
+    unsigned short per_transfer = ImageBlocksPerTransfer(dev, blocksize);
+    unsigned long totaltransferred = 0;
+    unsigned long crc = 0;
+    int error_status = 0;
+    ImageReadQueue q;
+    q.entries = 0;
+    q.next_lba = 0;
+
+    printf("  Reading %u blocks per transfer\n", per_transfer);
+
+    Progress progress;
+    ProgressBegin(progress, blocks * blocksize);
+    if (!FillImageReadQueue(dev, q, blocks, blocksize, per_transfer)) error_status = 3;
+    while (!error_status && q.entries > 0) {
+        ScsiCommand *cmd = q.cmd[0];
+        unsigned int len = q.len[0];
+        q.entries--;
+        for (int i = 0; i < q.entries; i++) {
+            q.cmd[i] = q.cmd[i + 1];
+            q.len[i] = q.len[i + 1];
+        }
+
+        if (!DeviceReadBlocksFinish(dev, cmd)) {
+            error_status = 3;
+            break;
+        }
+        // Queue the following read before writing this one out
+        if (!FillImageReadQueue(dev, q, blocks, blocksize, per_transfer)) error_status = 3;
+
+        if (fwrite(cmd->data_buf, len, 1, outfile) != 1) {
+            fprintf(stderr, "\nError writing to output file.\n");
+            error_status = 3;
+        } else {
+            crc = Crc32Update(crc, cmd->data_buf, len);
+            totaltransferred += len;
+            ProgressUpdate(progress, totaltransferred);
+        }
+        cmd->Release();
+    }
+
+    // Queued reads must complete before their buffers can be given back
+    for (int i = 0; i < q.entries; i++) {
+        q.cmd[i]->Wait();
+        q.cmd[i]->Release();
+    }
+    ProgressEnd(progress);
+
+    if (error_status) {
+        fprintf(stderr, "An error occurred reading the medium, the image file is incomplete.\n");
+        return error_status;
+    }
+    printf("  Received %lu bytes, CRC32 %08lX\n", totaltransferred, crc);
+    if (fflush(outfile) != 0) {
+        fprintf(stderr, "Error writing to output file.\n");
+        return 3;
+    }
+    return 0;
+}
+
+static int DoImageRead(int argc, const char *argv[])
+{
+    int r = InitSCSI();
+
+    (void)argc; // unused parameter
+
+    if (r) return r;
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    unsigned long blocks, blocksize;
+    if (!GetImageGeometry(*dev, blocks, blocksize)) return 1;
+
+    const char *outfn = argv[1];
+    printf("Output file: %s\n", outfn);
+    FILE *outfile = fopen(outfn, "rb");
+    if (outfile != NULL) {
+        fclose(outfile);
+        if (!AskForConfirmation("The output file already exists. Overwrite it?")) {
+            fprintf(stderr, "Not overwriting file, aborting.\n");
+            return 4;
+        }
+    }
+
+    r = CheckFreeSpace(outfn, blocks * blocksize);
+    if (r) return r;
+
+    outfile = fopen(outfn, "wb");
+    if (outfile == NULL) {
+        fprintf(stderr, "Could not open output file for writing\n");
+        return 2;
+    }
+    bool preallocated = blocks > 0 && SetFileLength(outfile, blocks * blocksize);
+
+    r = ReadImage(*dev, blocks, blocksize, outfile);
+    if (r && preallocated) {
+        long written = ftell(outfile);
+        if (written >= 0) SetFileLength(outfile, (unsigned long)written);
+    }
+    fclose(outfile);
+    return r;
+}
+
+/* The file is sent in transfers as large as the adapter allows, and the next
+ * part of the file is read while the previous write runs. With compare set,
+ * each extent is first read from the device, and only written if it differs. */
+static int WriteImage(const Device &dev, int infile, unsigned long filesize,
+    unsigned long blocksize, bool compare)
+{
+    unsigned short per_transfer = ImageBlocksPerTransfer(dev, blocksize);
+    unsigned long blocks = filesize / blocksize + (filesize % blocksize != 0);
+    // totaltransferred counts the image file bytes handled, written only
+    // those actually sent, which with compare set can be far fewer
+    unsigned long totaltransferred = 0;
+    unsigned long written = 0;
+    unsigned long crc = 0;
+    unsigned long transfers = 0;
+    unsigned long skipped = 0;
+    int error_status = 0;
+    ScsiCommand *pending = NULL;
+
+    printf("  Writing %u blocks per transfer\n", per_transfer);
+
+    Progress progress;
+    ProgressBegin(progress, filesize);
+    for (unsigned long lba = 0; lba < blocks && !error_status; ) {
+        unsigned short count = blocks - lba < per_transfer ? (unsigned short)(blocks - lba) : per_transfer;
+        unsigned int len = (unsigned int)(count * blocksize);
+
+        ScsiCommand *readcmd = NULL;
+        if (compare) {
+            readcmd = DeviceReadBlocksStart(dev, lba, count, len);
+            if (readcmd == NULL) {
+                error_status = 3;
+                break;
+            }
+        }
+        ScsiCommand *cmd = DeviceWriteBlocksPrepare(dev, lba, count, len);
+        if (cmd == NULL) {
+            if (readcmd != NULL) {
+                readcmd->Wait();
+                readcmd->Release();
+            }
+            error_status = 3;
+            break;
+        }
+
+        int r = ReadFull(infile, (char *)cmd->data_buf, len);
+        if (r <= 0) {
+            fprintf(stderr, "\nError reading file, aborting transfer.\n");
+            error_status = 3;
+        } else {
+            // A partial last block is padded with zeros
+            if ((unsigned int)r < len) _fmemset(cmd->data_buf + r, 0, len - r);
+            crc = Crc32Update(crc, cmd->data_buf, r);
+        }
+
+        bool same = false;
+        if (readcmd != NULL) {
+            if (!DeviceReadBlocksFinish(dev, readcmd)) {
+                error_status = 3;
+            } else {
+                same = _fmemcmp(readcmd->data_buf, cmd->data_buf, len) == 0;
+                readcmd->Release();
+            }
+        }
+
+        // Only one write is sent at a time, so a failure stops at the first bad extent
+        if (pending != NULL && !DeviceWriteBlocksFinish(dev, pending)) error_status = 18;
+        pending = NULL;
+        if (error_status || same) {
+            cmd->Release();
+            if (same) skipped++;
+        } else {
+            cmd->Post();
+            pending = cmd;
+        }
+        if (error_status) break;
+
+        transfers++;
+        if (!same) written += r;
+        totaltransferred += r;
+        ProgressUpdate(progress, totaltransferred);
+        lba += count;
+    }
+    if (pending != NULL && !DeviceWriteBlocksFinish(dev, pending) && !error_status) error_status = 18;
+    ProgressEnd(progress);
+
+    if (error_status) {
+        fprintf(stderr, "An error occurred during the transfer, the device contents may be damaged.\n");
+        return error_status;
+    }
+    if (compare) {
+        printf("  Compared %lu bytes, CRC32 %08lX\n", totaltransferred, crc);
+        printf("  Sent %lu bytes, skipped %lu of %lu transfers with unchanged contents\n",
+            written, skipped, transfers);
+    } else {
+        printf("  Sent %lu bytes, CRC32 %08lX\n", written, crc);
+    }
+    return 0;
+}
+
+static int DoImageWrite(int argc, const char *argv[])
+{
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    bool compare = false;
+    for (int argi = 2; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-c") == 0 || stricmp(argv[argi], "/c") == 0) {
+            compare = true;
+        } else {
+            fprintf(stderr, "Unknown image-write option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    const char *inpfn = argv[1];
+    int infile = _open(inpfn, O_RDONLY | O_BINARY);
+    if (infile == -1) {
+        fprintf(stderr, "The source file could not be opened for reading.\n");
+        return 1;
+    }
+    unsigned long filesize = (unsigned long)_filelength(infile);
+
+    unsigned long blocks, blocksize;
+    if (!GetImageGeometry(*dev, blocks, blocksize)) {
+        _close(infile);
+        return 1;
+    }
+    if (filesize / blocksize + (filesize % blocksize != 0) > blocks) {
+        fprintf(stderr, "The image file is larger than the medium.\n");
+        _close(infile);
+        return 5;
+    }
+    if (filesize % blocksize != 0) {
+        printf("The image file is not a whole number of blocks, the last block is padded with zeros.\n");
+    }
+
+    printf("Sending: %s => %s\n", inpfn, dev->name);
+    if (!AskForConfirmation("All data on the device will be overwritten. Continue?")) {
+        fprintf(stderr, "Not writing image, aborting.\n");
+        _close(infile);
+        return 4;
+    }
+
+    r = WriteImage(*dev, infile, filesize, blocksize, compare);
+    _close(infile);
+    return r;
+}
+
+/* Each benchmark test runs this many commands, and at most this many are queued */
+static const int BENCH_OPS = 128;
+static const int BENCH_MAX_DEPTH = 3;
+static const unsigned char BENCH_PATTERN = 0xE5;
+
+struct BenchResult {
+    unsigned long elapsed_us;
+    unsigned long latency_us[BENCH_OPS];
+};
+
+static int CompareULong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static unsigned long BenchLba(bool random, int op, unsigned short count, unsigned long blocks)
+{
+    unsigned long positions = blocks / count;
+    if (positions == 0) return 0;
+    if (random) {
+        unsigned long r = (unsigned long)rand() << 15 | rand();
+        return r % positions * count;
+    }
+    // Sequential tests start over at the beginning on small media
+    return (unsigned long)op % positions * count;
+}
+
+/* Run one test, keeping up to depth commands queued. The latency of each
+ * command is measured from sending it until its completion has been seen. */
+static bool RunBenchTest(const Device &dev, bool write, bool random, unsigned short count,
+    unsigned long blocksize, unsigned long blocks, int depth, BenchResult &res)
+{
+    ScsiCommand *queued[BENCH_MAX_DEPTH];
+    unsigned long started[BENCH_MAX_DEPTH];
+    int num_queued = 0;
+    int issued = 0;
+    int done = 0;
+    bool ok = true;
+    int len = (int)(count * blocksize);
+
+    unsigned long begin = ReadTimerTicks();
+    while (ok && done < BENCH_OPS) {
+        while (num_queued < depth && issued < BENCH_OPS) {
+            unsigned long lba = BenchLba(random, issued, count, blocks);
+            ScsiCommand *cmd;
+            if (write) {
+                cmd = DeviceWriteBlocksPrepare(dev, lba, count, len);
+                if (cmd != NULL) {
+                    _fmemset(cmd->data_buf, BENCH_PATTERN, len);
+                    cmd->Post();
+                }
+            } else {
+                cmd = DeviceReadBlocksStart(dev, lba, count, len);
+            }
+            if (cmd == NULL) {
+                ok = false;
+                break;
+            }
+            started[num_queued] = ReadTimerTicks();
+            queued[num_queued++] = cmd;
+            issued++;
+        }
+        if (!ok) break;
+
+        ScsiCommand *cmd = queued[0];
+        unsigned long start = started[0];
+        num_queued--;
+        for (int i = 0; i < num_queued; i++) {
+            queued[i] = queued[i + 1];
+            started[i] = started[i + 1];
+        }
+
+        if (write) {
+            ok = DeviceWriteBlocksFinish(dev, cmd);
+        } else {
+            ok = DeviceReadBlocksFinish(dev, cmd);
+            if (ok) cmd->Release();
+        }
+        res.latency_us[done++] = TimerTicksToMicroseconds(ReadTimerTicks() - start);
+    }
+    res.elapsed_us = TimerTicksToMicroseconds(ReadTimerTicks() - begin);
+
+    for (int i = 0; i < num_queued; i++) {
+        queued[i]->Wait();
+        queued[i]->Release();
+    }
+    return ok;
+}
+
+static void PrintBenchResult(const char *test, unsigned long bytes, int depth, BenchResult &res)
+{
+    unsigned long ms = res.elapsed_us / 1000;
+    if (ms == 0) ms = 1;
+
+    qsort(res.latency_us, BENCH_OPS, sizeof(res.latency_us[0]), CompareULong);
+    printf("%-6s %6lu %3d %8lu %6lu %8lu %8lu %8lu %8lu\n",
+        test, bytes, depth,
+        bytes * BENCH_OPS / 1024 * 1000 / ms,
+        (unsigned long)BENCH_OPS * 1000 / ms,
+        res.latency_us[BENCH_OPS / 2],
+        res.latency_us[BENCH_OPS * 95 / 100],
+        res.latency_us[BENCH_OPS * 99 / 100],
+        res.latency_us[BENCH_OPS - 1]);
+}
+
+/* Sequential and random transfers of each size from one block up to the
+ * largest the adapter allows, with one and with several commands queued */
+static int RunBenchmarks(const Device &dev, bool write, unsigned long blocks, unsigned long blocksize)
+{
+    static BenchResult res;
+    unsigned short per_transfer = ImageBlocksPerTransfer(dev, blocksize);
+    const int depths[] = { 1, BENCH_MAX_DEPTH };
+
+    for (unsigned short count = 1; ; count = count * 2 < per_transfer ? count * 2 : per_transfer) {
+        for (int random = 0; random <= 1; random++) {
+            for (int d = 0; d < 2; d++) {
+                if (!RunBenchTest(dev, write, random != 0, count, blocksize, blocks, depths[d], res)) {
+                    fprintf(stderr, "Benchmark aborted after a failed command.\n");
+                    return 3;
+                }
+                const char *test = write ? (random ? "rndwr" : "seqwr") : (random ? "rndrd" : "seqrd");
+                PrintBenchResult(test, count * blocksize, depths[d], res);
+            }
+        }
+        if (count >= per_transfer) break;
+    }
+    return 0;
+}
+
+static int DoDiskBenchmark(int argc, const char *argv[])
+{
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    bool write = false;
+    for (int argi = 1; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-w") == 0 || stricmp(argv[argi], "/w") == 0) {
+            write = true;
+        } else {
+            fprintf(stderr, "Unknown diskbench option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    // The benchmark never stores the medium, so it can be larger than 4 GB
+    unsigned long blocks, blocksize;
+    if (!GetImageGeometry(*dev, blocks, blocksize, false)) return 1;
+    if (blocks == 0) {
+        fprintf(stderr, "The medium is empty.\n");
+        return 1;
+    }
+
+    if (write && !AskForConfirmation("The write test overwrites data all over the device. Continue?")) {
+        fprintf(stderr, "Not running write test, aborting.\n");
+        return 4;
+    }
+
+    // Fixed seed, so runs on different machines read the same blocks
+    srand(1);
+    InitTimer();
+    printf(
+        "\n"
+        "Test    Bytes  QD     kB/s   IOPS   P50 us   P95 us   P99 us   Max us\n"
+        "---------------------------------------------------------------------\n"
+    );
+    r = RunBenchmarks(*dev, false, blocks, blocksize);
+    if (!r && write) r = RunBenchmarks(*dev, true, blocks, blocksize);
+    return r;
+}
+
+/* Latencies are counted in the same buckets as the command statistics */
+static const int PING_BAR_WIDTH = 40;
+
+static void PrintLatencyHistogram(const unsigned long buckets[STATS_BUCKETS], unsigned long count)
+{
+    unsigned long largest = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (buckets[b] > largest) largest = buckets[b];
+    }
+    if (largest == 0) return;
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (buckets[b] == 0) continue;
+        int bar = (int)(buckets[b] * PING_BAR_WIDTH / largest);
+        if (b < STATS_BUCKETS - 1) {
+            printf("  < %8lu us ", 2UL << b);
+        } else {
+            printf("  >=%8lu us ", 1UL << b);
+        }
+        printf("%6lu %3lu%% ", buckets[b], buckets[b] * 100 / count);
+        for (int i = 0; i < bar; i++) putchar('*');
+        putchar('\n');
+    }
+}
+
+/* Send the same command without data transfer over and over, to see the
+ * overhead of a single command in the driver, adapter and device firmware */
+static int DoPing(int argc, const char *argv[])
+{
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    unsigned long count = 16;
+    bool toolbox = false;
+    for (int argi = 1; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-t") == 0 || stricmp(argv[argi], "/t") == 0) {
+            toolbox = true;
+        } else if ((stricmp(argv[argi], "-n") == 0 || stricmp(argv[argi], "/n") == 0) && argi + 1 < argc) {
+            if (sscanf(argv[++argi], "%lu", &count) != 1 || count == 0) {
+                fprintf(stderr, "Invalid count: %s\n", argv[argi]);
+                return 9;
+            }
+        } else {
+            fprintf(stderr, "Unknown ping option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    const char *cmdname = GetCommandName(toolbox ? TOOLBOX_COUNT_FILES : SCSI_TST_U_RDY);
+    printf("Pinging device %s type %d (%s) with %s...\n",
+        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype), cmdname);
+
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long min_us = 0xFFFFFFFFUL, max_us = 0;
+    unsigned long total_us = 0, total_jitter_us = 0, prev_us = 0;
+    unsigned long replies = 0, not_ready = 0;
+    memset(buckets, 0, sizeof(buckets));
+
+    InitTimer();
+    for (unsigned long seq = 0; seq < count; seq++) {
+        unsigned long start = ReadTimerTicks();
+        int result = toolbox ? (ToolboxCountFiles(*dev) >= 0 ? 1 : -1) : DeviceTestUnitReady(*dev, NULL);
+        unsigned long us = TimerTicksToMicroseconds(ReadTimerTicks() - start);
+
+        if (result < 0) {
+            printf("  seq %lu: failed\n", seq);
+            continue;
+        }
+        // A device that is not ready still answered, which is what is measured
+        if (result == 0) not_ready++;
+        printf("  seq %lu: %lu us%s\n", seq, us, result == 0 ? " (not ready)" : "");
+
+        if (us < min_us) min_us = us;
+        if (us > max_us) max_us = us;
+        // Jitter is the mean difference between consecutive replies
+        if (replies > 0) total_jitter_us += us > prev_us ? us - prev_us : prev_us - us;
+        prev_us = us;
+        total_us += us;
+        replies++;
+
+        buckets[StatsLatencyBucket(us)]++;
+    }
+
+    printf("\n%lu commands sent, %lu answered, %lu not ready, %lu failed\n",
+        count, replies, not_ready, count - replies);
+    if (replies == 0) return 1;
+
+    printf("Latency min %lu us, mean %lu us, max %lu us, jitter %lu us\n\n",
+        min_us, total_us / replies, max_us, replies > 1 ? total_jitter_us / (replies - 1) : 0);
+    PrintLatencyHistogram(buckets, replies);
+
+    return replies == count ? 0 : 1;
+}
+
+static void MakeLocalPath(char *path, size_t pathsize, const char *dirname, const char *filename)
+{
+    size_t dirlen = strlen(dirname);
+    const char *sep = "\\";
+
+    // Avoid doubling the separator, and keep "C:" meaning the current directory on C:
+    if (dirlen == 0 || dirname[dirlen - 1] == '\\' || dirname[dirlen - 1] == '/' || dirname[dirlen - 1] == ':') {
+        sep = "";
+    }
+    snprintf(path, pathsize, "%s%s%s", dirname, sep, filename);
+}
+
+struct LocalFileEntry {
+    char name[13];
+    unsigned long size;
+
+    bool operator== (const LocalFileEntry &other) const {
+        return stricmp(name, other.name) == 0;
+    }
+};
+
+static bool GetLocalDirList(const char *dirname, FixedVector<LocalFileEntry> &files)
+{
+    char pattern[_MAX_PATH];
+    struct find_t ff;
+
+    files.clear();
+    MakeLocalPath(pattern, sizeof(pattern), dirname, "*.*");
+
+    unsigned r = _dos_findfirst(pattern, _A_NORMAL | _A_RDONLY | _A_ARCH, &ff);
+    if (r != 0) {
+        // An empty directory is fine, a missing one is not
+        return r == 0x12; // DOS error: no more files
+    }
+
+    // Count the files first, so the listing can be allocated at its final size
+    int count = 0;
+    do {
+        count++;
+    } while (_dos_findnext(&ff) == 0);
+    _dos_findclose(&ff);
+    if (!files.reserveOnHeap(count)) {
+        fprintf(stderr, "Out of memory for %d local files\n", count);
+        return false;
+    }
+
+    if (_dos_findfirst(pattern, _A_NORMAL | _A_RDONLY | _A_ARCH, &ff) != 0) return true;
+    do {
+        LocalFileEntry lfe;
+        strncpy(lfe.name, ff.name, sizeof(lfe.name));
+        lfe.name[sizeof(lfe.name) - 1] = '\0';
+        lfe.size = ff.size;
+        files.append(lfe);
+    } while (_dos_findnext(&ff) == 0);
+    _dos_findclose(&ff);
+
+    return true;
+}
+
+/* A shared directory file and a local file are considered the same file if
+ * the local name is either the exact remote name, or the name 'get' would
+ * have generated for it. */
+static bool SharedFileMatchesLocal(const ToolboxFileEntry &tfe, const char *localname)
+{
+    char cleanname[13];
+
+    if (stricmp(tfe.name, localname) == 0) return true;
+    CleanFileName(cleanname, tfe.name, sizeof(tfe.name));
+    return stricmp(cleanname, localname) == 0;
+}
+
+static bool SharedFileSizeMatches(const ToolboxFileEntry &tfe, unsigned long size)
+{
+    // Local files can not be larger than 4 GB, so any use of the top byte
+    // of the 40 bit size means the files differ.
+    return tfe.size[0] == 0 && tfe.GetSize() == size;
+}
+
+/* Two long shared directory names can clean up to the same local name, and the
+ * files would then overwrite each other at every sync. Returns the other file. */
+static int FindLocalNameCollision(const FixedVector<ToolboxFileEntry> &files, int index)
+{
+    char cleanname[13];
+    char othername[13];
+
+    CleanFileName(cleanname, files[index].name, sizeof(files[index].name));
+    for (int i = 0; i < files.entries(); i++) {
+        if (i == index || files[i].type == 0) continue;
+        CleanFileName(othername, files[i].name, sizeof(files[i].name));
+        if (stricmp(cleanname, othername) == 0) return i;
+    }
+    return -1;
+}
+
+/* Download the shared directory files that are missing or have a different size locally */
+static void SyncGetFiles(const Device &dev, const char *localdir, const FixedVector<ToolboxFileEntry> &files,
+    const FixedVector<LocalFileEntry> &localfiles, bool dry_run, int &transferred, int &errors)
+{
+    char localpath[_MAX_PATH];
+
+    for (int ri = 0; ri < files.entries(); ri++) {
+        const ToolboxFileEntry &tfe = files[ri];
+        // Subdirectories are listed, but can not be downloaded
+        if (tfe.type == 0) continue;
+
+        int other = FindLocalNameCollision(files, ri);
+        if (other >= 0) {
+            fprintf(stderr, "Skipped: %s has the same local name as %s\n", tfe.name, files[other].name);
+            errors++;
+            continue;
+        }
+
+        const LocalFileEntry *lfe = NULL;
+        for (int li = 0; li < localfiles.entries(); li++) {
+            if (SharedFileMatchesLocal(tfe, localfiles[li].name)) {
+                lfe = &localfiles[li];
+                break;
+            }
+        }
+        if (lfe != NULL && SharedFileSizeMatches(tfe, lfe->size)) continue;
+
+        printf("%s %s\n", lfe ? "Changed:" : "New:    ", tfe.name);
+        if (dry_run) continue;
+
+        if (lfe != NULL) {
+            MakeLocalPath(localpath, sizeof(localpath), localdir, lfe->name);
+        } else {
+            char cleanname[13];
+            CleanFileName(cleanname, tfe.name, sizeof(tfe.name));
+            MakeLocalPath(localpath, sizeof(localpath), localdir, cleanname);
+        }
+        printf("Output file: %s\n", localpath);
+        if (DownloadSharedDirFile(dev, tfe, localpath)) {
+            errors++;
+        } else {
+            transferred++;
+        }
+    }
+}
+
+static int DoSync(int argc, const char *argv[])
+{
+    bool upload;
+    bool dry_run = false;
+    int errors = 0;
+    int transferred = 0;
+
+    if (stricmp(argv[2], "get") == 0) {
+        upload = false;
+    } else if (stricmp(argv[2], "put") == 0) {
+        upload = true;
+    } else {
+        fprintf(stderr, "Invalid sync direction, specify 'get' or 'put'\n");
+        return 9;
+    }
+    for (int argi = 3; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-n") == 0 || stricmp(argv[argi], "/n") == 0) {
+            dry_run = true;
+        } else {
+            fprintf(stderr, "Unknown sync option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    const char *localdir = argv[1];
+    FixedVector<LocalFileEntry> localfiles;
+    if (!GetLocalDirList(localdir, localfiles)) {
+        fprintf(stderr, "Could not read local directory: %s\n", localdir);
+        return 1;
+    }
+
+    printf("Retrieving file list from device %s type %d (%s)...\n",
+        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
+
+    FixedVector<ToolboxFileEntry> files;
+    if (!ToolboxGetSharedDirList(*dev, files)) {
+        return 17;
+    }
+
+    char localpath[_MAX_PATH];
+
+    if (upload) {
+        for (int li = 0; li < localfiles.entries(); li++) {
+            const LocalFileEntry &lfe = localfiles[li];
+            const ToolboxFileEntry *tfe = NULL;
+            for (int ri = 0; ri < files.entries(); ri++) {
+                if (SharedFileMatchesLocal(files[ri], lfe.name)) {
+                    tfe = &files[ri];
+                    break;
+                }
+            }
+            if (tfe != NULL && SharedFileSizeMatches(*tfe, lfe.size)) continue;
+
+            printf("%s %s\n", tfe ? "Changed:" : "New:    ", lfe.name);
+            if (dry_run) continue;
+
+            MakeLocalPath(localpath, sizeof(localpath), localdir, lfe.name);
+            if (UploadSharedDirFile(*dev, localpath, tfe ? tfe->name : lfe.name)) {
+                errors++;
+            } else {
+                transferred++;
+            }
+        }
+    } else {
+        SyncGetFiles(*dev, localdir, files, localfiles, dry_run, transferred, errors);
+    }
+
+    if (dry_run) {
+        printf("Dry run, no files transferred.\n");
+    } else {
+        printf("%d files transferred, %d errors.\n", transferred, errors);
+    }
+
+    return errors ? 3 : 0;
+}
+
+/* The shared directory is listed again after this many polls, even when the number
+ * of files is unchanged, to notice files that were replaced or are still growing */
+static const int WATCH_RELIST_POLLS = 30;
+
+/* BIOS keyboard buffer head and tail, equal when no key is waiting */
+static volatile unsigned short far *_bios_kbd_head = (volatile unsigned short far *)MK_FP(0x40, 0x1A);
+static volatile unsigned short far *_bios_kbd_tail = (volatile unsigned short far *)MK_FP(0x40, 0x1C);
+
+/* Check for a key press on the keyboard itself. DOS would read standard input,
+ * which is the script when running "run -". */
+static bool BiosKeyPressed(void)
+{
+    if (*_bios_kbd_head == *_bios_kbd_tail) return false;
+
+    // Take the key out of the buffer, so it is not left for the next program
+    union REGS regs;
+    regs.h.ah = 0x00;
+    int86(0x16, &regs, &regs);
+    return true;
+}
+
+/* Wait for the next poll, returns true if a key was pressed to stop watching */
+static bool WatchWaitOrKey(unsigned int interval_ms)
+{
+    const unsigned int STEP_MS = 100;
+
+    for (unsigned int waited = 0; waited < interval_ms; waited += STEP_MS) {
+        if (BiosKeyPressed()) return true;
+        delay(STEP_MS);
+    }
+    return false;
+}
+
+/* List the shared and local directories, and download what is new or changed */
+static bool WatchSync(const Device &dev, const char *localdir, int &transferred, int &errors)
+{
+    FixedVector<LocalFileEntry> localfiles;
+    if (!GetLocalDirList(localdir, localfiles)) {
+        fprintf(stderr, "Could not read local directory: %s\n", localdir);
+        return false;
+    }
+
+    FixedVector<ToolboxFileEntry> files;
+    ToolboxInvalidateListingCache();
+    if (!ToolboxGetSharedDirList(dev, files)) return false;
+
+    SyncGetFiles(dev, localdir, files, localfiles, false, transferred, errors);
+    return true;
+}
+
+/* Keep downloading new files from the shared directory until a key is pressed.
+ * Between listings only the number of files is asked for, a single small command. */
+static int DoWatch(int argc, const char *argv[])
+{
+    unsigned int interval = 1;
+
+    for (int argi = 2; argi < argc; argi++) {
+        if ((stricmp(argv[argi], "-i") == 0 || stricmp(argv[argi], "/i") == 0) && argi + 1 < argc) {
+            if (sscanf(argv[++argi], "%u", &interval) != 1 || interval == 0 || interval > 60) {
+                fprintf(stderr, "Invalid interval: %s\n", argv[argi]);
+                return 9;
+            }
+        } else {
+            fprintf(stderr, "Unknown watch option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
+    int r = InitSCSI();
+
+    if (r) return r;
+
+    const Device *dev = GetDeviceByName(argv[0]);
+    if (!dev) {
+        fprintf(stderr, "Device ID not found: %s\n", argv[0]);
+        return 16;
+    }
+
+    const char *localdir = argv[1];
+    int transferred = 0;
+    int errors = 0;
+
+    printf("Watching shared directory of device %s type %d (%s), press any key to stop...\n",
+        dev->name, dev->devtype, GetDeviceTypeName(dev->devtype));
+    if (!WatchSync(*dev, localdir, transferred, errors)) return 17;
+
+    int last_count = ToolboxCountFiles(*dev);
+    int polls = 0;
+    while (!WatchWaitOrKey(interval * 1000)) {
+        int count = ToolboxCountFiles(*dev);
+        // A failed poll is tried again at the next interval
+        if (count < 0) continue;
+        if (count == last_count && ++polls < WATCH_RELIST_POLLS) continue;
+
+        // After a failed sync, wait for the next change or the periodic relist
+        // before trying again, rather than relisting at every poll
+        if (!WatchSync(*dev, localdir, transferred, errors)) errors++;
+        last_count = count;
+        polls = 0;
+    }
+
+    printf("%d files transferred, %d errors.\n", transferred, errors);
+    return errors ? 3 : 0;
+}
+
+static bool CalculateFileCrc(const char *filename, unsigned long *crc)
+{
+    int infile = _open(filename, O_RDONLY | O_BINARY);
+    if (infile == -1) return false;
+
+    const unsigned int BUFSIZE = 4096;
+    unsigned char *buf = new unsigned char[BUFSIZE];
+    int r;
+
+    *crc = 0;
+    while ((r = _read(infile, buf, BUFSIZE)) > 0) {
+        *crc = Crc32Update(*crc, buf, r);
+    }
+
+    delete[] buf;
+    _close(infile);
+    return r == 0;
+}
+
+static int VerifyChecksumFile(const char *sfvfn)
+{
+    FILE *sfv = fopen(sfvfn, "r");
+    if (sfv == NULL) {
+        fprintf(stderr, "Could not open checksum file: %s\n", sfvfn);
+        return 1;
+    }
+
+    // File names in the checksum file are relative to its own location
+    char dirname[_MAX_PATH];
+    strncpy(dirname, sfvfn, sizeof(dirname));
+    dirname[sizeof(dirname) - 1] = '\0';
+    char *dirend = dirname;
+    for (char *p = dirname; *p != '\0'; p++) {
+        if (*p == '\\' || *p == '/' || *p == ':') dirend = p + 1;
+    }
+    *dirend = '\0';
+
+    char line[_MAX_PATH + 16];
+    char path[_MAX_PATH];
+    int checked = 0;
+    int failed = 0;
+    while (fgets(line, sizeof(line), sfv) != NULL) {
+        // Strip line ending, and skip comments and empty lines
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == ';' || line[0] == '\0') continue;
+
+        // The checksum is the last word on the line, the filename is everything before it
+        char *crcstr = strrchr(line, ' ');
+        unsigned long expected;
+        if (crcstr == NULL || sscanf(crcstr + 1, "%lx", &expected) != 1) {
+            fprintf(stderr, "Invalid line in checksum file: %s\n", line);
+            failed++;
+            continue;
+        }
+        while (crcstr > line && crcstr[-1] == ' ') crcstr--;
+        *crcstr = '\0';
+
+        unsigned long actual;
+        snprintf(path, sizeof(path), "%s%s", dirname, line);
+        checked++;
+        if (!CalculateFileCrc(path, &actual)) {
+            printf("%-32s MISSING\n", line);
+            failed++;
+        } else if (actual != expected) {
+            printf("%-32s FAILED (%08lX, expected %08lX)\n", line, actual, expected);
+            failed++;
+        } else {
+            printf("%-32s OK\n", line);
+        }
+    }
+    fclose(sfv);
+
+    printf("%d files checked, %d failed.\n", checked, failed);
+    return failed ? 3 : 0;
+}
+
+static int DoChecksum(int argc, const char *argv[])
+{
+    int errors = 0;
+
+    if (stricmp(argv[0], "-c") == 0 || stricmp(argv[0], "/c") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Missing checksum file to verify\n");
+            return 8;
+        }
+        return VerifyChecksumFile(argv[1]);
+    }
+
+    // Output is in SFV format, so it can be redirected to a checksum file
+    for (int argi = 0; argi < argc; argi++) {
+        char basebuf[_MAX_PATH];
+        unsigned long crc;
+        if (CalculateFileCrc(argv[argi], &crc)) {
+            printf("%s %08lX\n", CopyBaseName(basebuf, sizeof(basebuf), argv[argi]), crc);
+        } else {
+            fprintf(stderr, "Could not read file: %s\n", argv[argi]);
+            errors++;
+        }
+    }
+
+    return errors ? 1 : 0;
+}
+
+static int DoReplayTrace(int argc, const char *argv[])
+{
+    bool list_records = false;
+
+    for (int argi = 1; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-l") == 0 || stricmp(argv[argi], "/l") == 0) {
+            list_records = true;
+        } else {
+            fprintf(stderr, "Unknown replay option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+
+    FILE *tracefile = fopen(argv[0], "rb");
+    if (tracefile == NULL) {
+        fprintf(stderr, "Could not open trace file: %s\n", argv[0]);
+        return 1;
+    }
+    unsigned long ticks_per_sec;
+    if (!TraceOpen(tracefile, ticks_per_sec)) {
+        fprintf(stderr, "Not a trace file, or unsupported trace version: %s\n", argv[0]);
+        fclose(tracefile);
+        return 1;
+    }
+
+    TraceRecord rec;
+    // Only SENSE_LEN bytes are recorded, the rest of the sense data reads as zero
+    SENSE_DATA_FMT sense;
+    memset(&sense, 0, sizeof(sense));
+    unsigned long first_ticks = 0;
+    unsigned long end_ticks = 0;
+    unsigned long records = 0;
+
+    StatsReset();
+    if (list_records) {
+        printf("    Time ms  Addr   Dir   Length  Status  Latency us  CDB\n");
+    }
+    while (TraceReadRecord(tracefile, rec, (unsigned char *)&sense)) {
+        if (records == 0) first_ticks = rec.start_ticks;
+        end_ticks = rec.start_ticks + rec.elapsed_ticks;
+        records++;
+
+        StatsRecordCommandTime(rec.cdb[0], rec.buflen, TraceTicksToMicroseconds(rec.elapsed_ticks, ticks_per_sec),
+            rec.status, rec.hastat, rec.targstat);
+
+        if (list_records) {
+            printf("%11lu  %d:%d:%d  %-4s %7lu  %02x%02x%02x  %10lu  ",
+                TraceTicksToMicroseconds(rec.start_ticks - first_ticks, ticks_per_sec) / 1000,
+                rec.adapter_id, rec.target_id, rec.lun,
+                (rec.flags & SRB_DIR_OUT) ? "out" : (rec.flags & SRB_DIR_IN) ? "in" : "-",
+                rec.buflen, rec.status, rec.hastat, rec.targstat,
+                TraceTicksToMicroseconds(rec.elapsed_ticks, ticks_per_sec));
+            for (int i = 0; i < rec.cdblen && i < (int)sizeof(rec.cdb); i++) printf("%02x", rec.cdb[i]);
+            printf("\n");
+            if (rec.sense_len > 0) PrintSense(&sense);
+        }
+    }
+    fclose(tracefile);
+
+    printf("%lu commands in trace\n", records);
+    unsigned long scsi_ms = StatsPrintTable(stdout);
+    unsigned long trace_ms = TraceTicksToMicroseconds(end_ticks - first_ticks, ticks_per_sec) / 1000;
+    printf("Trace time %lu ms, in SCSI commands %lu ms, between commands %lu ms\n",
+        trace_ms, scsi_ms, trace_ms > scsi_ms ? trace_ms - scsi_ms : 0);
+
+    return 0;
+}
+
+static int DoDebugFlag(int argc, const char *argv[])
+{
+    bool perform_set = false;
+    bool new_flag = false;
+    if (argc >= 2) {
+        perform_set = true;
+        switch (argv[1][0]) {
+            case '1':
+            case 'y':
+            case 't':
             case 'Y':
             case 'T':
                 new_flag = true;
@@ -598,17 +2568,61 @@ static void PrintLicense(void)
 static void PrintHelp(void)
 {
     printf(
-        "Usage:  SCSITB <command> [parameters]\n"
+        "Usage:  SCSITB [options] <command> [parameters]\n"
+        "\n"
+        "Options:\n"
+        "  --stats[=file]          Print SCSI command statistics when done,\n"
+        "                          or write them to a file.\n"
+        "  --trace=file            Record all SCSI commands to a trace file.\n"
+        "  --retries=n             Retry failed block transfers up to n times.\n"
+        "  --timeout=s             Use a fixed timeout of s seconds for commands.\n"
+        "  --timeout=class:s,...   Fixed timeout for probe, control or transfer.\n"
+        "  --wait=mode             How to wait for commands: auto, spin, yield, halt.\n"
         "\n"
         "Commands:\n"
         "  info                    List all available SCSI adapters and devices.\n"
         "  debug <dev> [flag]      Show or set device firmware debug flag.\n"
-        "  lsimg <dev>             List available images for the given device.\n"
-        "  setimg <dev> <img>      Change the mounted image in the given device, to\n"
-        "                          the image with the given index or filename.\n"
-        "  lsdir <dev>             List shared directory for the given decice.\n"
-        "  get <dev> <file> [name] Download a file from the shared directory.\n"
-        "  put <dev> <filename>    Upload a file to the shared directory.\n"
+        "  lsimg <dev|all>         List available images for the given device,\n"
+        "                          or for all toolbox devices together.\n"
+        "  setimg <dev> <img> [-w] Change the mounted image in the given device, to\n"
+        "                          the image with the given index or filename,\n"
+        "                          -w waits until the device reports the change.\n"
+        "  lsdir <dev|all>         List shared directory for the given decice,\n"
+        "                          or for all toolbox devices together.\n"
+        "  get <dev> <file> [name] [-s]\n"
+        "                          Download a file from the shared directory,\n"
+        "                          name - writes it to standard output,\n"
+        "                          -s skips over zero blocks on network drives.\n"
+        "  put <dev> <filename> [name] [-z]\n"
+        "                          Upload a file to the shared directory, dev can\n"
+        "                          be a list like 0,1:2 or all for all devices,\n"
+        "                          filename - reads it from standard input,\n"
+        "                          -z skips sending blocks of zeros.\n"
+        "  copy <dev> <file> <dev2> [name]\n"
+        "                          Copy a file from one device's shared directory\n"
+        "                          to another's.\n"
+        "  image-read <dev> <file> Save the whole medium of a disk device to an\n"
+        "                          image file.\n"
+        "  image-write <dev> <file> [-c]\n"
+        "                          Write an image file to the whole medium of a disk\n"
+        "                          device, -c only writes parts that differ.\n"
+        "  diskbench <dev> [-w]    Measure read throughput and latency of a disk\n"
+        "                          device, -w also runs a destructive write test.\n"
+        "  ping <dev> [-n count] [-t]\n"
+        "                          Measure the time for single commands without data,\n"
+        "                          -t uses a toolbox command instead of TEST UNIT READY.\n"
+        "  sync <dev> <dir> <get|put> [-n]\n"
+        "                          Transfer only new or changed files between the\n"
+        "                          shared directory and a local directory.\n"
+        "                          -n only lists what would be transferred.\n"
+        "  watch <dev> <dir> [-i s]\n"
+        "                          Download new or changed shared directory files\n"
+        "                          as they appear, checking every s seconds.\n"
+        "  crc <file> [...]        Calculate CRC32 checksums of local files.\n"
+        "  crc -c <sfvfile>        Verify local files against an SFV checksum file.\n"
+        "  replay <tracefile> [-l] Summarize a trace file, -l lists every command.\n"
+        "  run <script|-> [-k]     Run commands from a script file or standard input,\n"
+        "                          -k continues after a failed command.\n"
         "\n"
         "Please see the documentation for more information about supported\n"
         "devices, how to configure your device for compatibility, etc.\n"
@@ -617,27 +2631,78 @@ static void PrintHelp(void)
 }
 
 
-int main(int argc, const char *argv[])
+static const char *_stats_filename = NULL;
+
+static void PrintStatsAtExit(void)
 {
-    int missingargs = 0;
+    if (_stats_filename == NULL) {
+        StatsPrint(stdout);
+        return;
+    }
 
-    if (argc < 2) {
-        PrintBanner();
-        PrintHelp();
-        return 8;
+    FILE *statsfile = fopen(_stats_filename, "w");
+    if (statsfile == NULL) {
+        fprintf(stderr, "Could not open statistics file for writing: %s\n", _stats_filename);
+        return;
     }
+    StatsPrint(statsfile);
+    fclose(statsfile);
+}
 
-    if (strcmpi(argv[1], "help") == 0 || strcmpi(argv[1], "h") == 0 ||
-        strcmpi(argv[1], "-h") == 0 || strcmpi(argv[1], "-?") == 0 ||
-        strcmpi(argv[1], "-help") == 0 || strcmpi(argv[1], "--help") == 0 ||
-        strcmpi(argv[1], "/h") == 0 || strcmpi(argv[1], "/?") == 0) {
-        /* So many ways to ask for help. Don't let the user down. */
-        PrintBanner();
-        PrintLicense();
-        PrintHelp();
-        return 0;
+/* Returns true if the argument was a global option, and has been applied */
+static bool ParseGlobalOption(const char *arg)
+{
+    if (strcmpi(arg, "--stats") == 0 || strnicmp(arg, "--stats=", 8) == 0) {
+        // Given more than once, the last file name wins and the report is printed once
+        _stats_filename = arg[7] == '=' ? arg + 8 : NULL;
+        if (!_stats_enabled) {
+            StatsBegin();
+            atexit(PrintStatsAtExit);
+        }
+        return true;
+    }
+    if (strnicmp(arg, "--retries=", 10) == 0) {
+        if (sscanf(arg + 10, "%d", &_toolbox_retries) != 1 || _toolbox_retries < 0) {
+            fprintf(stderr, "Invalid number of retries: %s\n", arg + 10);
+            exit(9);
+        }
+        return true;
+    }
+    if (strnicmp(arg, "--timeout=", 10) == 0) {
+        if (!SetASPITimeouts(arg + 10)) {
+            fprintf(stderr, "Invalid timeout: %s\n", arg + 10);
+            exit(9);
+        }
+        return true;
+    }
+    if (strnicmp(arg, "--wait=", 7) == 0) {
+        if (!SetASPIWaitMode(arg + 7)) {
+            fprintf(stderr, "Invalid wait mode: %s\n", arg + 7);
+            exit(9);
+        }
+        return true;
+    }
+    if (strnicmp(arg, "--trace=", 8) == 0) {
+        bool was_tracing = _trace_enabled;
+        if (!TraceBegin(arg + 8)) {
+            fprintf(stderr, "Could not open trace file for writing: %s\n", arg + 8);
+            exit(2);
+        }
+        if (!was_tracing) atexit(TraceEnd);
+        return true;
     }
 
+    return false;
+}
+
+
+static int DoRunScript(int argc, const char *argv[]);
+
+/* Run the command in argv[1], with its parameters following */
+static int RunCommand(int argc, const char *argv[])
+{
+    int missingargs = 0;
+
     if (strcmpi(argv[1], "info") == 0) {
         return DoDeviceInfo(argc - 2, argv + 2);
     }
@@ -690,6 +2755,86 @@ int main(int argc, const char *argv[])
         }
     }
 
+    if (strcmpi(argv[1], "copy") == 0) {
+        if (argc >= 5) {
+            return DoCopySharedDirFile(argc - 2, argv + 2);
+        } else {
+            missingargs = 3;
+        }
+    }
+
+    if (strcmpi(argv[1], "image-read") == 0) {
+        if (argc >= 4) {
+            return DoImageRead(argc - 2, argv + 2);
+        } else {
+            missingargs = 2;
+        }
+    }
+
+    if (strcmpi(argv[1], "image-write") == 0) {
+        if (argc >= 4) {
+            return DoImageWrite(argc - 2, argv + 2);
+        } else {
+            missingargs = 2;
+        }
+    }
+
+    if (strcmpi(argv[1], "diskbench") == 0) {
+        if (argc >= 3) {
+            return DoDiskBenchmark(argc - 2, argv + 2);
+        } else {
+            missingargs = 1;
+        }
+    }
+
+    if (strcmpi(argv[1], "ping") == 0) {
+        if (argc >= 3) {
+            return DoPing(argc - 2, argv + 2);
+        } else {
+            missingargs = 1;
+        }
+    }
+
+    if (strcmpi(argv[1], "watch") == 0) {
+        if (argc >= 4) {
+            return DoWatch(argc - 2, argv + 2);
+        } else {
+            missingargs = 2;
+        }
+    }
+
+    if (strcmpi(argv[1], "crc") == 0) {
+        if (argc >= 3) {
+            return DoChecksum(argc - 2, argv + 2);
+        } else {
+            missingargs = 1;
+        }
+    }
+
+    if (strcmpi(argv[1], "replay") == 0) {
+        if (argc >= 3) {
+            return DoReplayTrace(argc - 2, argv + 2);
+        } else {
+            missingargs = 1;
+        }
+    }
+
+    if (strcmpi(argv[1], "sync") == 0) {
+        if (argc >= 5) {
+            return DoSync(argc - 2, argv + 2);
+        } else {
+            missingargs = 3;
+        }
+    }
+
+    if (strcmpi(argv[1], "run") == 0) {
+        if (argc >= 3) {
+            return DoRunScript(argc - 2, argv + 2);
+        } else {
+            missingargs = 1;
+        }
+    }
+
     if (missingargs) {
         fprintf(stderr, "Missing parameters to command: %s\n\n", argv[1]);
         PrintHelp();
@@ -702,3 +2847,137 @@ int main(int argc, const char *argv[])
 }
 
 
+/* Split a script line into words, in place. Words are separated by spaces,
+ * and can be quoted with double quotes to include spaces.
+ * Returns the number of words, or -1 if there are too many. */
+static int SplitScriptLine(char *line, const char *words[], int maxwords)
+{
+    int count = 0;
+    char *p = line;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        // Comment lines, and the rest of a line after a comment marker, are ignored
+        if (*p == '\0' || *p == '#' || *p == ';') break;
+        if (count >= maxwords) return -1;
+
+        if (*p == '"') {
+            words[count++] = ++p;
+            while (*p != '\0' && *p != '"') p++;
+        } else {
+            words[count++] = p;
+            while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        }
+        if (*p == '\0') break;
+        *p++ = '\0';
+    }
+
+    return count;
+}
+
+static int DoRunScript(int argc, const char *argv[])
+{
+    static bool running = false;
+    const int MAX_WORDS = 16;
+    bool keep_going = false;
+    int errors = 0;
+    int result = 0;
+    int lineno = 0;
+    char line[256];
+
+    for (int argi = 1; argi < argc; argi++) {
+        if (stricmp(argv[argi], "-k") == 0 || stricmp(argv[argi], "/k") == 0) {
+            keep_going = true;
+        } else {
+            fprintf(stderr, "Unknown run option: %s\n", argv[argi]);
+            return 9;
+        }
+    }
+    if (running) {
+        fprintf(stderr, "Scripts can not run other scripts\n");
+        return 9;
+    }
+
+    FILE *script = stdin;
+    if (strcmp(argv[0], "-") != 0) {
+        script = fopen(argv[0], "r");
+        if (script == NULL) {
+            fprintf(stderr, "Could not open script file: %s\n", argv[0]);
+            return 2;
+        }
+    }
+
+    // The bus scan, device list, listings and SCSI commands are shared by
+    // all commands in the script
+    running = true;
+    _script_on_stdin = script == stdin;
+    ToolboxEnableListingCache();
+
+    while (fgets(line, sizeof(line), script) != NULL) {
+        const char *words[MAX_WORDS + 1];
+        lineno++;
+
+        // words[0] stands in for the program name, like in main
+        words[0] = "run";
+        int count = SplitScriptLine(line, words + 1, MAX_WORDS);
+        if (count == 0) continue;
+        if (count < 0) {
+            fprintf(stderr, "Line %d: Too many parameters\n", lineno);
+            result = 9;
+        } else {
+            printf("> ");
+            for (int i = 1; i <= count; i++) printf(i > 1 ? " %s" : "%s", words[i]);
+            printf("\n");
+            result = RunCommand(count + 1, words);
+        }
+
+        if (result != 0) {
+            errors++;
+            if (!keep_going) {
+                fprintf(stderr, "Line %d: Command failed with code %d, stopping\n", lineno, result);
+                break;
+            }
+            fprintf(stderr, "Line %d: Command failed with code %d\n", lineno, result);
+        }
+    }
+
+    if (script != stdin) fclose(script);
+    running = false;
+    _script_on_stdin = false;
+
+    if (keep_going && errors > 0) {
+        printf("%d commands failed.\n", errors);
+        return 3;
+    }
+    return result;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    while (argc >= 2 && ParseGlobalOption(argv[1])) {
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2) {
+        PrintBanner();
+        PrintHelp();
+        return 8;
+    }
+
+    if (strcmpi(argv[1], "help") == 0 || strcmpi(argv[1], "h") == 0 ||
+        strcmpi(argv[1], "-h") == 0 || strcmpi(argv[1], "-?") == 0 ||
+        strcmpi(argv[1], "-help") == 0 || strcmpi(argv[1], "--help") == 0 ||
+        strcmpi(argv[1], "/h") == 0 || strcmpi(argv[1], "/?") == 0) {
+        /* So many ways to ask for help. Don't let the user down. */
+        PrintBanner();
+        PrintLicense();
+        PrintHelp();
+        return 0;
+    }
+
+    return RunCommand(argc, argv);
+}
+
+
@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2025 Niels Martin Hansen
+ *
+ * This file is part of the Emulated SCSI Toolbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <stdlib.h>
+#include <conio.h>
+#include <i86.h>
+
+#include "../include/estb.h"
+
+
+/* BIOS tick counter, incremented by the timer interrupt 18.2 times per second */
+static volatile unsigned long far *_bios_ticks = (volatile unsigned long far *)MK_FP(0x40, 0x6C);
+
+/* Put the PIT back in the mode 3 the BIOS set up, for DOS and the programs run after */
+static void RestoreTimer(void)
+{
+    _disable();
+    outp(0x43, 0x36);
+    outp(0x40, 0);
+    outp(0x40, 0);
+    _enable();
+}
+
+void InitTimer(void)
+{
+    static bool initialized = false;
+
+    if (initialized) return;
+    initialized = true;
+
+    /* The BIOS runs PIT channel 0 in mode 3 (square wave), where the counter
+     * runs through its range twice per interrupt. Reprogram it to mode 2
+     * (rate generator) with the same divisor, so the counter decrements
+     * once per interrupt period and can be combined with the BIOS ticks.
+     * The interrupt rate is unchanged. */
+    _disable();
+    outp(0x43, 0x34);
+    outp(0x40, 0);
+    outp(0x40, 0);
+    _enable();
+    atexit(RestoreTimer);
+}
+
+unsigned long ReadTimerTicks(void)
+{
+    unsigned long ticks, ticks_after;
+    unsigned char lo, hi;
+
+    do {
+        ticks = *_bios_ticks;
+        _disable();
+        outp(0x43, 0x00); /* latch channel 0 counter */
+        lo = inp(0x40);
+        hi = inp(0x40);
+        _enable();
+        /* If the timer interrupt happened meanwhile, the counter wrapped
+         * and the reading can not be combined with the old tick count */
+        ticks_after = *_bios_ticks;
+    } while (ticks != ticks_after);
+
+    return ticks << 16 | (unsigned short)~(lo | hi << 8);
+}
+
+unsigned long TimerTicksToMicroseconds(unsigned long ticks)
+{
+    /* 1193182 ticks per second, rounded to 1193 ticks per millisecond */
+    return ticks / 1193 * 1000 + (ticks % 1193) * 1000 / 1193;
+}
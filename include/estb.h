@@ -20,13 +20,99 @@
 #ifndef ESTB_H
 #define ESTB_H
 
-#include <wcvector.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "aspi.h"
 #include "scsidefs.h"
 #include "toolbox.h"
 
 
+/* Session memory arena, a single block allocated when the session starts.
+ * Space is reused when blocks are returned in the reverse order of allocation,
+ * a block returned early is only reused once the blocks above it are returned. */
+bool ArenaInit(unsigned int size);
+void far *ArenaAlloc(unsigned int size);
+void ArenaFree(void far *p, unsigned int size);
+void ArenaGetUsage(unsigned int &size, unsigned int &peak, unsigned long &allocs);
+
+/* Arena space reserved for listings, besides the adapter and device tables:
+ * room for three full device listings in use at the same time. Local directory
+ * listings can be much longer, and take their storage from the heap instead. */
+#define ARENA_LISTING_SIZE (3 * MAX_FILE_LISTING_FILES * sizeof(ToolboxFileEntry))
+
+/* Vector with a capacity fixed at reserve time, taking its storage from the arena,
+ * or from the heap with reserveOnHeap for lists too long for the arena.
+ * Only for plain structs, items are copied by assignment and never destructed. */
+template <class T>
+class FixedVector {
+    T far *_items;
+    int _entries;
+    int _capacity;
+    bool _on_heap;
+
+    FixedVector(const FixedVector &);
+    FixedVector &operator= (const FixedVector &);
+
+public:
+    FixedVector() : _items(NULL), _entries(0), _capacity(0), _on_heap(false) { }
+    ~FixedVector() { release(); }
+
+    /* Make room for at least capacity items, growing discards the current contents */
+    bool reserve(int capacity)
+    {
+        if (capacity <= _capacity) return true;
+        release();
+        _items = (T far *)ArenaAlloc(capacity * sizeof(T));
+        if (_items == NULL) return false;
+        _capacity = capacity;
+        return true;
+    }
+
+    /* The heap also limits a single block to one segment */
+    bool reserveOnHeap(int capacity)
+    {
+        if (capacity <= _capacity) return true;
+        release();
+        if ((unsigned long)capacity * sizeof(T) > 0xFFF0UL) return false;
+        _items = new T[capacity];
+        if (_items == NULL) return false;
+        _capacity = capacity;
+        _on_heap = true;
+        return true;
+    }
+
+    void release()
+    {
+        if (_items != NULL && _on_heap) {
+            delete[] _items;
+        } else if (_items != NULL) {
+            ArenaFree(_items, _capacity * sizeof(T));
+        }
+        _items = NULL;
+        _on_heap = false;
+        _entries = 0;
+        _capacity = 0;
+    }
+
+    int append(const T &item)
+    {
+        if (_entries >= _capacity) return 0;
+        _items[_entries++] = item;
+        return 1;
+    }
+
+    void clear() { _entries = 0; }
+    int entries() const { return _entries; }
+    int capacity() const { return _capacity; }
+    bool isEmpty() const { return _entries == 0; }
+
+    T &operator[] (int i) { return _items[i]; }
+    const T &operator[] (int i) const { return _items[i]; }
+    T &last() { return _items[_entries - 1]; }
+};
+
+
 struct Adapter {
     short ha_id;
     short scsi_id;
@@ -68,27 +154,33 @@ struct DeviceInquiryResult {
     char toolbox_flag;
 };
 
+/* A SCSI command with its data buffer, obtained from Device::PrepareCommand
+ * and given back with Release. The functions are implemented by the backend
+ * linked into the program. */
 struct ScsiCommand {
     unsigned char far *data_buf;
     unsigned char far *cdb;
     const Device far *device;
-    
-    virtual int GetBufSize() const = 0;
-    virtual unsigned char GetCDBSize() const = 0;
-    virtual unsigned char GetStatus() const = 0;
-    virtual unsigned char GetFlags() const = 0;
-    virtual unsigned char GetHAStatus() const = 0;
-    virtual unsigned char GetTargetStatus() const = 0;
-    virtual const SENSE_DATA_FMT far *GetSenseData() const = 0;
-
-    virtual unsigned short Execute();
-    
-    virtual ~ScsiCommand() { }
+
+    int GetBufSize() const;
+    unsigned char GetCDBSize() const;
+    unsigned char GetStatus() const;
+    unsigned char GetFlags() const;
+    unsigned char GetHAStatus() const;
+    unsigned char GetTargetStatus() const;
+    const SENSE_DATA_FMT far *GetSenseData() const;
+
+    /* Send the command and wait for it to complete, can be called again to resend */
+    unsigned short Execute();
+    /* Send the command without waiting, Wait must be called before anything else */
+    void Post();
+    unsigned short Wait();
+    void Release();
 };
 
 
-extern WCValOrderedVector<Adapter> _adapters;
-extern WCValOrderedVector<Device> _devices;
+extern FixedVector<Adapter> _adapters;
+extern FixedVector<Device> _devices;
 
 int InitSCSI();
 
@@ -100,22 +192,168 @@ unsigned short far SendASPICommand(void far *pSrb);
 
 int InitASPI(void);
 
+/* Set fixed command timeouts, either "seconds" for all commands,
+ * or a list like "probe:2,control:10,transfer:60" */
+bool SetASPITimeouts(const char *spec);
+
+/* Select how to wait for commands to complete: "auto", "spin", "yield" or "halt" */
+bool SetASPIWaitMode(const char *mode);
+
 const char *GetDeviceTypeName(int device_type);
 const char *GetToolboxDeviceTypeName(char toolbox_devtype);
 
 void PrintSense(const SENSE_DATA_FMT far *s);
+const char *GetSenseKeyName(int sense_key);
+
+enum ScsiErrorClass {
+    SCSI_ERROR_NONE = 0,
+    SCSI_ERROR_RETRY,   /* transient, the same command may succeed if sent again */
+    SCSI_ERROR_FATAL,   /* sending the same command again will not help */
+};
+
+int ClassifyScsiError(unsigned char status, unsigned char hastat, unsigned char targstat, const SENSE_DATA_FMT far *sense);
 
-bool ToolboxGetImageList(const Device &dev, WCValOrderedVector<ToolboxFileEntry> &images);
+/* Find where in a memory block at physical address phys a buffer can be placed,
+ * so it is aligned by align_mask and does not cross a 64 kB DMA page.
+ * Returns the offset into the block, or DMA_NO_FIT if the block is too small. */
+#define DMA_NO_FIT 0xFFFFFFFFUL
+unsigned long DmaBufferOffset(unsigned long phys, unsigned long blocksize, unsigned long bufsize, unsigned short align_mask);
+
+/* Number of times a failed block transfer is retried, when the error allows it */
+extern int _toolbox_retries;
+
+/* Calculate CRC-32 incrementally, start with crc = 0 and pass the previous result for following blocks */
+unsigned long Crc32Update(unsigned long crc, const unsigned char far *data, unsigned int len);
+
+/* Progress display for transfers, only drawn when stdout is a terminal */
+struct Progress {
+    FILE *out;
+    unsigned long total;        /* bytes, 0 if not known in advance */
+    unsigned long done;
+    unsigned long last_done;
+    unsigned long rate;         /* bytes per second, moving average */
+    int last_percent;
+    clock_t start;
+    clock_t last_update;
+};
+
+void ProgressBegin(Progress &p, unsigned long total);
+void ProgressUpdate(Progress &p, unsigned long done);
+void ProgressEnd(Progress &p);
+
+/* High resolution timer, ticks at 1.193182 MHz and wraps around after about an hour */
+void InitTimer(void);
+unsigned long ReadTimerTicks(void);
+unsigned long TimerTicksToMicroseconds(unsigned long ticks);
+
+/* Command statistics, only collected after StatsBegin has been called */
+extern bool _stats_enabled;
+void StatsReset(void);
+void StatsBegin(void);
+void StatsRecordCommand(unsigned char opcode, unsigned long bytes, unsigned long ticks,
+    unsigned char status, unsigned char hastat, unsigned char targstat);
+/* Same as StatsRecordCommand, with the time already converted to microseconds */
+void StatsRecordCommandTime(unsigned char opcode, unsigned long bytes, unsigned long us,
+    unsigned char status, unsigned char hastat, unsigned char targstat);
+/* Latencies are sorted into buckets by powers of two of microseconds, bucket b
+ * holds latencies below 2 << b and the last one everything longer */
+const int STATS_BUCKETS = 32;
+int StatsLatencyBucket(unsigned long us);
+unsigned long StatsPrintTable(FILE *out);
+void StatsRecordRetry(unsigned char opcode);
+void StatsPrint(FILE *out);
+const char *GetCommandName(unsigned char opcode);
+void StatsRecordHeapAlloc(unsigned long bytes);
+void StatsRecordHeapFree(unsigned long bytes);
+void StatsRecordDmaRealign(void);
+
+/* SRB trace recording, every executed command is appended to the trace file after TraceBegin */
+#define TRACE_VERSION 1
+
+#pragma pack(push, 1)
+struct TraceFileHeader {
+    char magic[4];
+    unsigned short version;
+    unsigned short record_size;
+    unsigned long ticks_per_sec;
+};
+
+struct TraceRecord {
+    unsigned long start_ticks;   /* timer ticks when the command was sent */
+    unsigned long elapsed_ticks; /* timer ticks until the command completed */
+    unsigned long buflen;
+    unsigned char adapter_id;
+    unsigned char target_id;
+    unsigned char lun;
+    unsigned char flags;         /* SRB_Flags, includes the transfer direction */
+    unsigned char cdblen;
+    unsigned char cdb[12];
+    unsigned char status;
+    unsigned char hastat;
+    unsigned char targstat;
+    unsigned char sense_len;     /* number of sense data bytes following the record */
+};
+#pragma pack(pop)
+
+extern bool _trace_enabled;
+bool TraceBegin(const char *filename);
+void TraceRecordCommand(const ScsiCommand &cmd, unsigned long start_ticks, unsigned long elapsed_ticks);
+void TraceEnd(void);
+bool TraceOpen(FILE *f, unsigned long &ticks_per_sec);
+unsigned long TraceTicksToMicroseconds(unsigned long ticks, unsigned long ticks_per_sec);
+bool TraceReadRecord(FILE *f, TraceRecord &rec, unsigned char sense[SENSE_LEN]);
+
+/* Keep listings between commands, for running several commands in one session */
+void ToolboxEnableListingCache(void);
+unsigned int ToolboxListingCacheSize(void);
+/* Forget cached listings, for commands that expect the device contents to change */
+void ToolboxInvalidateListingCache(void);
+
+bool ToolboxGetImageList(const Device &dev, FixedVector<ToolboxFileEntry> &images);
 bool ToolboxSetImage(const Device &dev, int newimage);
-bool ToolboxGetSharedDirList(const Device &dev, WCValOrderedVector<ToolboxFileEntry> &images);
+bool ToolboxGetSharedDirList(const Device &dev, FixedVector<ToolboxFileEntry> &images);
 int ToolboxGetFileBlock(const Device &dev, int fileindex, unsigned long blockindex, unsigned char databuf[], int bufsize);
+/* Read a file block in the background, to overlap with commands on another adapter */
+ScsiCommand *ToolboxGetFileBlockStart(const Device &dev, int fileindex, unsigned long blockindex, int bufsize);
+int ToolboxGetFileBlockFinish(const Device &dev, ScsiCommand *cmd, unsigned char databuf[], int bufsize);
 bool ToolboxListDevices(const Device &dev, ToolboxDeviceList &devlist);
 bool ToolboxSendFileBegin(const Device &dev, const char *filename);
 bool ToolboxSendFileBlock(const Device &dev, unsigned short data_size, unsigned long block_index, const char *data);
+ScsiCommand *ToolboxSendFileBlockStart(const Device &dev, unsigned short data_size, unsigned long block_index, const char *data);
+bool ToolboxSendFileBlockFinish(const Device &dev, ScsiCommand *cmd);
+/* Send the same block to several devices at once, skipping devices with a
+ * non-zero status, and setting the status of devices the block failed for */
+void ToolboxSendFileBlockAll(const FixedVector<const Device *> &devs, FixedVector<int> &status,
+    unsigned short data_size, unsigned long block_index, const char *data);
 bool ToolboxSendFileEnd(const Device &dev);
+/* Listings from several devices, fetched together. The counts are found first, so the
+ * caller can size the catalog, a device that failed or has nothing to list has count <= 0. */
+struct CatalogEntry {
+    const Device *dev;
+    ToolboxFileEntry file;
+};
+
+int ToolboxCountAll(const FixedVector<const Device *> &devs, bool images, FixedVector<int> &counts);
+int ToolboxListAll(const FixedVector<const Device *> &devs, bool images, const FixedVector<int> &counts,
+    CatalogEntry catalog[], int capacity);
+
+/* Number of files in the shared directory, or -1 on failure */
+int ToolboxCountFiles(const Device &dev);
 int ToolboxGetDebugFlag(const Device &dev);
 bool ToolboxSetDebugFlag(const Device &dev, bool debug_enabled);
 
+/* Returns 1 when the unit is ready, 0 when not ready with the reason in sense, -1 on failure */
+int DeviceTestUnitReady(const Device &dev, SENSE_DATA_FMT *sense);
+
+/* Block device access for imaging. A started read is finished with DeviceReadBlocksFinish,
+ * on success the data is in the command buffer and the caller releases the command. */
+bool DeviceReadCapacity(const Device &dev, unsigned long &blocks, unsigned long &blocksize);
+ScsiCommand *DeviceReadBlocksStart(const Device &dev, unsigned long lba, unsigned short count, int bufsize);
+bool DeviceReadBlocksFinish(const Device &dev, ScsiCommand *cmd);
+/* A prepared write is filled in by the caller and sent with Post, finishing it releases the command */
+ScsiCommand *DeviceWriteBlocksPrepare(const Device &dev, unsigned long lba, unsigned short count, int bufsize);
+bool DeviceWriteBlocksFinish(const Device &dev, ScsiCommand *cmd);
+
 
 #endif /* ESTB_H */
 
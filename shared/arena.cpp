@@ -0,0 +1,119 @@
+/**
+ * Copyright (C) 2025 Niels Martin Hansen
+ *
+ * This file is part of the Emulated SCSI Toolbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/estb.h"
+
+
+/* All containers for a session take their storage from one block, allocated
+ * once. Blocks are handed out from the bottom up and are returned in reverse
+ * order, which matches how the listings are used: a listing is fetched, used
+ * and discarded before the function returns. */
+static unsigned char far *_arena = NULL;
+static unsigned int _arena_size = 0;
+static unsigned int _arena_used = 0;
+static unsigned int _arena_peak = 0;
+static unsigned long _arena_allocs = 0;
+
+/* Keep the blocks aligned for the sake of DMA and the 16 bit bus */
+static unsigned int ArenaRoundUp(unsigned int size)
+{
+    return (size + 1) & ~1U;
+}
+
+bool ArenaInit(unsigned int size)
+{
+    if (_arena != NULL) return _arena_size >= size;
+
+    size = ArenaRoundUp(size);
+    _arena = (unsigned char far *)malloc(size);
+    if (_arena == NULL) return false;
+    _arena_size = size;
+    _arena_used = 0;
+    return true;
+}
+
+void far *ArenaAlloc(unsigned int size)
+{
+    // Commands that do not scan the SCSI bus still get an arena for their listings
+    if (_arena == NULL && !ArenaInit(ARENA_LISTING_SIZE)) return NULL;
+
+    size = ArenaRoundUp(size);
+    if (size > _arena_size - _arena_used) return NULL;
+
+    void far *p = _arena + _arena_used;
+    _arena_used += size;
+    if (_arena_used > _arena_peak) _arena_peak = _arena_used;
+    _arena_allocs++;
+    return p;
+}
+
+/* Blocks freed while a later block is still in use are remembered, and
+ * given back together with the block above them when that is freed */
+struct ArenaBlock {
+    unsigned int offset;
+    unsigned int size;
+};
+
+static const int ARENA_MAX_PENDING = 8;
+static ArenaBlock _arena_pending[ARENA_MAX_PENDING];
+static int _arena_num_pending = 0;
+
+void ArenaFree(void far *p, unsigned int size)
+{
+    if (p == NULL) return;
+
+    size = ArenaRoundUp(size);
+    unsigned int offset = (unsigned int)((unsigned char far *)p - _arena);
+    if (_arena == NULL || offset > _arena_used || size > _arena_used - offset) {
+        fprintf(stderr, "Arena: freeing a block that was not allocated\n");
+        return;
+    }
+
+    if (offset + size != _arena_used) {
+        if (_arena_num_pending >= ARENA_MAX_PENDING) {
+            fprintf(stderr, "Arena: too many blocks freed out of order, %u bytes lost\n", size);
+            return;
+        }
+        _arena_pending[_arena_num_pending].offset = offset;
+        _arena_pending[_arena_num_pending].size = size;
+        _arena_num_pending++;
+        return;
+    }
+
+    _arena_used = offset;
+    for (int i = 0; i < _arena_num_pending; ) {
+        if (_arena_pending[i].offset + _arena_pending[i].size != _arena_used) {
+            i++;
+            continue;
+        }
+        _arena_used = _arena_pending[i].offset;
+        _arena_pending[i] = _arena_pending[--_arena_num_pending];
+        i = 0;
+    }
+}
+
+void ArenaGetUsage(unsigned int &size, unsigned int &peak, unsigned long &allocs)
+{
+    size = _arena_size;
+    peak = _arena_peak;
+    allocs = _arena_allocs;
+}
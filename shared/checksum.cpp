@@ -0,0 +1,58 @@
+/**
+ * Copyright (C) 2025 Niels Martin Hansen
+ *
+ * This file is part of the Emulated SCSI Toolbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <stdlib.h>
+
+#include "../include/estb.h"
+
+
+/* CRC-32 as used by zip, PNG, SFV files etc. (reflected polynomial 0xEDB88320)
+ *
+ * A single 256 entry table is used. Larger slicing tables would not fit
+ * comfortably in the near data segment, and the table lookup per byte is
+ * still much faster than the SCSI transfer feeding it. */
+static unsigned long _crc32_table[256];
+static bool _crc32_table_ready = false;
+
+static void Crc32BuildTable(void)
+{
+    for (unsigned int n = 0; n < 256; n++) {
+        unsigned long c = n;
+        for (int k = 0; k < 8; k++) {
+            if (c & 1) {
+                c = 0xEDB88320UL ^ (c >> 1);
+            } else {
+                c = c >> 1;
+            }
+        }
+        _crc32_table[n] = c;
+    }
+    _crc32_table_ready = true;
+}
+
+unsigned long Crc32Update(unsigned long crc, const unsigned char far *data, unsigned int len)
+{
+    if (!_crc32_table_ready) Crc32BuildTable();
+
+    crc = crc ^ 0xFFFFFFFFUL;
+    while (len-- > 0) {
+        crc = _crc32_table[(unsigned char)crc ^ *data++] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFUL;
+}
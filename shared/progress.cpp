@@ -0,0 +1,102 @@
+/**
+ * Copyright (C) 2025 Niels Martin Hansen
+ *
+ * This file is part of the Emulated SCSI Toolbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <stdio.h>
+#include <io.h>
+#include <time.h>
+
+#include "../include/estb.h"
+
+
+/* Console output is slow on old machines, so the progress line is only
+ * redrawn a few times per second, or when a larger step has been made. */
+static const clock_t PROGRESS_INTERVAL = CLOCKS_PER_SEC / 4;
+static const int PROGRESS_PERCENT_STEP = 5;
+
+void ProgressBegin(Progress &p, unsigned long total)
+{
+    p.out = isatty(fileno(stdout)) ? stdout : NULL;
+    p.total = total;
+    p.done = 0;
+    p.last_done = 0;
+    p.rate = 0;
+    p.last_percent = 0;
+    p.start = p.last_update = clock();
+}
+
+static void ProgressDraw(Progress &p)
+{
+    unsigned long done_kb = p.done / 1024;
+
+    if (p.total > 0) {
+        fprintf(p.out, "  %lu / %lu kB (%d%%)", done_kb, p.total / 1024, p.last_percent);
+    } else {
+        fprintf(p.out, "  %lu kB", done_kb);
+    }
+    if (p.rate > 0) {
+        fprintf(p.out, ", %lu kB/s", p.rate / 1024);
+        if (p.total > p.done) {
+            unsigned long eta = (p.total - p.done) / p.rate;
+            fprintf(p.out, ", %lu:%02lu:%02lu left", eta / 3600, eta / 60 % 60, eta % 60);
+        }
+    }
+    fprintf(p.out, "    \r");
+    fflush(p.out);
+}
+
+void ProgressUpdate(Progress &p, unsigned long done)
+{
+    p.done = done;
+    if (p.out == NULL) return;
+
+    clock_t now = clock();
+    int percent = 0;
+    if (p.total > 10000000UL) {
+        percent = (int)(done / (p.total / 100));
+    } else if (p.total > 0) {
+        percent = (int)(done * 100 / p.total);
+    }
+    if (percent > 100) percent = 100;
+    if (now - p.last_update < PROGRESS_INTERVAL && percent < p.last_percent + PROGRESS_PERCENT_STEP) return;
+
+    // Exponentially weighted moving average of throughput in bytes per second
+    unsigned long elapsed = (unsigned long)(now - p.last_update);
+    if (elapsed > 0) {
+        unsigned long rate = (done - p.last_done) * CLOCKS_PER_SEC / elapsed;
+        p.rate = p.rate == 0 ? rate : (3 * p.rate + rate) / 4;
+        p.last_done = done;
+        p.last_update = now;
+    }
+    p.last_percent = percent;
+
+    ProgressDraw(p);
+}
+
+void ProgressEnd(Progress &p)
+{
+    if (p.out == NULL) return;
+
+    // Show the average for the whole transfer as the final result
+    unsigned long elapsed = (unsigned long)(clock() - p.start);
+    p.rate = elapsed > 0 ? p.done / elapsed * CLOCKS_PER_SEC : 0;
+    p.last_percent = 100;
+    p.total = p.done;
+    ProgressDraw(p);
+    fprintf(p.out, "\n");
+}
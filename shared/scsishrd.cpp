@@ -22,6 +22,11 @@
 
 #include "../include/aspi.h"
 #include "../include/scsidefs.h"
+#include "../include/estb.h"
+
+#ifndef KEY_ABORTEDCMD
+#define KEY_ABORTEDCMD  0x0B    // Aborted Command
+#endif
 
 const char *GetDeviceTypeName(int device_type)
 {
@@ -54,3 +59,107 @@ const char *GetDeviceTypeName(int device_type)
     }
 }
 
+
+const char *GetSenseKeyName(int sense_key)
+{
+    switch (sense_key & 0x0F) {
+        case KEY_NOSENSE:
+            return "No sense";
+        case KEY_RECERROR:
+            return "Recovered error";
+        case KEY_NOTREADY:
+            return "Not ready";
+        case KEY_MEDIUMERR:
+            return "Medium error";
+        case KEY_HARDERROR:
+            return "Hardware error";
+        case KEY_ILLGLREQ:
+            return "Illegal request";
+        case KEY_UNITATT:
+            return "Unit attention";
+        case KEY_DATAPROT:
+            return "Data protect";
+        case KEY_BLANKCHK:
+            return "Blank check";
+        case KEY_ABORTEDCMD:
+            return "Aborted command";
+        case KEY_MISCOMP:
+            return "Miscompare";
+        default:
+            return "Other";
+    }
+}
+
+int ClassifyScsiError(unsigned char status, unsigned char hastat, unsigned char targstat, const SENSE_DATA_FMT far *sense)
+{
+    switch (status) {
+        case SS_COMP:
+            return SCSI_ERROR_NONE;
+        case SS_ABORTED:
+            return SCSI_ERROR_RETRY;
+        case SS_ERR:
+            break;
+        default:
+            /* Invalid requests, missing devices, ASPI manager problems */
+            return SCSI_ERROR_FATAL;
+    }
+
+    switch (hastat) {
+        case HASTAT_OK:
+            break;
+        case HASTAT_SEL_TO:
+            /* Nothing answered at this address */
+            return SCSI_ERROR_FATAL;
+        default:
+            /* Bus level problems: timeouts, parity errors, resets, phase errors */
+            return SCSI_ERROR_RETRY;
+    }
+
+    switch (targstat) {
+        case STATUS_GOOD:
+            /* Error reported without any reason, could be anything */
+            return SCSI_ERROR_RETRY;
+        case STATUS_BUSY:
+        case STATUS_QFULL:
+            return SCSI_ERROR_RETRY;
+        case STATUS_CHKCOND:
+            break;
+        default:
+            return SCSI_ERROR_FATAL;
+    }
+
+    switch (sense->SenseKey & 0x0F) {
+        case KEY_NOSENSE:
+        case KEY_RECERROR:
+        case KEY_UNITATT:
+        case KEY_ABORTEDCMD:
+            return SCSI_ERROR_RETRY;
+        case KEY_NOTREADY:
+            /* Medium not present will not go away by waiting */
+            return sense->AddSenseCode == 0x3A ? SCSI_ERROR_FATAL : SCSI_ERROR_RETRY;
+        case KEY_MEDIUMERR:
+        case KEY_HARDERROR:
+            /* SD card read/write hiccups are reported as these */
+            return SCSI_ERROR_RETRY;
+        default:
+            /* Illegal request, data protect etc. will fail the same way again */
+            return SCSI_ERROR_FATAL;
+    }
+}
+
+unsigned long DmaBufferOffset(unsigned long phys, unsigned long blocksize, unsigned long bufsize, unsigned short align_mask)
+{
+    const unsigned long DMA_PAGE = 0x10000UL;
+
+    if (bufsize > DMA_PAGE) return DMA_NO_FIT;
+
+    unsigned long start = (phys + align_mask) & ~(unsigned long)align_mask;
+    if (bufsize > 0 && start / DMA_PAGE != (start + bufsize - 1) / DMA_PAGE) {
+        // Start at the next page instead, which suits any alignment
+        start = (start / DMA_PAGE + 1) * DMA_PAGE;
+    }
+
+    unsigned long offset = start - phys;
+    if (offset + bufsize > blocksize) return DMA_NO_FIT;
+    return offset;
+}
@@ -0,0 +1,251 @@
+/**
+ * Copyright (C) 2025 Niels Martin Hansen
+ *
+ * This file is part of the Emulated SCSI Toolbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/aspi.h"
+#include "../include/scsidefs.h"
+#include "../include/toolbox.h"
+#include "../include/estb.h"
+
+
+bool _stats_enabled = false;
+
+/* The latency buckets give percentiles within a factor of two without storing every sample */
+const int STATS_MAX_OPCODES = 16;
+
+struct OpcodeStats {
+    unsigned char opcode;
+    unsigned long count;
+    unsigned long errors;
+    unsigned long retries;
+    unsigned long bytes;
+    unsigned long total_ms;
+    unsigned long total_us_rem;
+    unsigned long min_us;
+    unsigned long max_us;
+    unsigned long buckets[STATS_BUCKETS];
+    /* status of the most recent failed command */
+    unsigned char last_status;
+    unsigned char last_hastat;
+    unsigned char last_targstat;
+};
+
+static OpcodeStats _opstats[STATS_MAX_OPCODES];
+static int _num_opstats = 0;
+static clock_t _stats_start;
+
+/* Heap use by command objects and their buffers */
+static unsigned long _heap_allocs = 0;
+static unsigned long _heap_bytes = 0;
+static unsigned long _heap_peak = 0;
+/* Buffers placed differently, so the ASPI driver does not need a bounce buffer */
+static unsigned long _dma_realigned = 0;
+
+
+void StatsReset(void)
+{
+    memset(_opstats, 0, sizeof(_opstats));
+    _num_opstats = 0;
+    _heap_allocs = 0;
+    _heap_bytes = 0;
+    _heap_peak = 0;
+    _dma_realigned = 0;
+}
+
+void StatsBegin(void)
+{
+    StatsReset();
+    _stats_start = clock();
+    InitTimer();
+    _stats_enabled = true;
+}
+
+static OpcodeStats *GetOpcodeStats(unsigned char opcode)
+{
+    for (int i = 0; i < _num_opstats; i++) {
+        if (_opstats[i].opcode == opcode) return &_opstats[i];
+    }
+    if (_num_opstats >= STATS_MAX_OPCODES) return NULL;
+
+    OpcodeStats *os = &_opstats[_num_opstats++];
+    os->opcode = opcode;
+    os->min_us = 0xFFFFFFFFUL;
+    return os;
+}
+
+void StatsRecordCommand(unsigned char opcode, unsigned long bytes, unsigned long ticks,
+    unsigned char status, unsigned char hastat, unsigned char targstat)
+{
+    StatsRecordCommandTime(opcode, bytes, TimerTicksToMicroseconds(ticks), status, hastat, targstat);
+}
+
+void StatsRecordCommandTime(unsigned char opcode, unsigned long bytes, unsigned long us,
+    unsigned char status, unsigned char hastat, unsigned char targstat)
+{
+    OpcodeStats *os = GetOpcodeStats(opcode);
+    if (os == NULL) return;
+
+    os->count++;
+    os->total_ms += us / 1000;
+    os->total_us_rem += us % 1000;
+    if (os->total_us_rem >= 1000) {
+        os->total_ms++;
+        os->total_us_rem -= 1000;
+    }
+    if (us < os->min_us) os->min_us = us;
+    if (us > os->max_us) os->max_us = us;
+
+    os->buckets[StatsLatencyBucket(us)]++;
+
+    if (status == SS_COMP) {
+        os->bytes += bytes;
+    } else {
+        os->errors++;
+        os->last_status = status;
+        os->last_hastat = hastat;
+        os->last_targstat = targstat;
+    }
+}
+
+int StatsLatencyBucket(unsigned long us)
+{
+    int bucket = 0;
+    for (unsigned long v = us; v > 1 && bucket < STATS_BUCKETS - 1; v >>= 1) bucket++;
+    return bucket;
+}
+
+void StatsRecordRetry(unsigned char opcode)
+{
+    if (!_stats_enabled) return;
+
+    OpcodeStats *os = GetOpcodeStats(opcode);
+    if (os != NULL) os->retries++;
+}
+
+void StatsRecordHeapAlloc(unsigned long bytes)
+{
+    _heap_allocs++;
+    _heap_bytes += bytes;
+    if (_heap_bytes > _heap_peak) _heap_peak = _heap_bytes;
+}
+
+void StatsRecordHeapFree(unsigned long bytes)
+{
+    _heap_bytes = bytes < _heap_bytes ? _heap_bytes - bytes : 0;
+}
+
+void StatsRecordDmaRealign(void)
+{
+    _dma_realigned++;
+}
+
+static unsigned long PercentileMicroseconds(const OpcodeStats &os, int percent)
+{
+    unsigned long threshold = (os.count * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += os.buckets[bucket];
+        if (seen >= threshold) {
+            // Report the upper bound of the bucket, but never more than the actual maximum
+            unsigned long upper = bucket < STATS_BUCKETS - 1 ? (2UL << bucket) - 1 : 0xFFFFFFFFUL;
+            return upper < os.max_us ? upper : os.max_us;
+        }
+    }
+    return os.max_us;
+}
+
+const char *GetCommandName(unsigned char opcode)
+{
+    static char unknown_buffer[8];
+
+    switch (opcode) {
+        case SCSI_TST_U_RDY:         return "TEST_UNIT_READY";
+        case SCSI_REQ_SENSE:         return "REQUEST_SENSE";
+        case SCSI_INQUIRY:           return "INQUIRY";
+        case SCSI_RD_CAPAC:          return "READ_CAPACITY";
+        case SCSI_READ10:            return "READ10";
+        case SCSI_WRITE10:           return "WRITE10";
+        case TOOLBOX_LIST_FILES:     return "TOOLBOX_LIST_FILES";
+        case TOOLBOX_GET_FILE:       return "TOOLBOX_GET_FILE";
+        case TOOLBOX_COUNT_FILES:    return "TOOLBOX_COUNT_FILES";
+        case TOOLBOX_SEND_FILE_PREP: return "TOOLBOX_SEND_PREP";
+        case TOOLBOX_SEND_FILE_10:   return "TOOLBOX_SEND_FILE_10";
+        case TOOLBOX_SEND_FILE_END:  return "TOOLBOX_SEND_END";
+        case TOOLBOX_TOGGLE_DEBUG:   return "TOOLBOX_TOGGLE_DEBUG";
+        case TOOLBOX_LIST_CDS:       return "TOOLBOX_LIST_CDS";
+        case TOOLBOX_SET_NEXT_CD:    return "TOOLBOX_SET_NEXT_CD";
+        case TOOLBOX_LIST_DEVICES:   return "TOOLBOX_LIST_DEVICES";
+        case TOOLBOX_COUNT_CDS:      return "TOOLBOX_COUNT_CDS";
+        default:
+            sprintf(unknown_buffer, "OP_%02X", opcode);
+            return unknown_buffer;
+    }
+}
+
+unsigned long StatsPrintTable(FILE *out)
+{
+    unsigned long scsi_ms = 0;
+
+    fprintf(out,
+        "\n"
+        "Command               Count Errors Retry   Min us   Avg us   P95 us   Max us    kB/s\n"
+        "------------------------------------------------------------------------------------\n"
+    );
+    for (int i = 0; i < _num_opstats; i++) {
+        const OpcodeStats &os = _opstats[i];
+        unsigned long avg_us = (os.total_ms / os.count) * 1000 +
+            ((os.total_ms % os.count) * 1000 + os.total_us_rem) / os.count;
+        unsigned long kbps = os.total_ms > 0 ? os.bytes / os.total_ms : 0;
+        scsi_ms += os.total_ms;
+
+        fprintf(out, "%-20s %6lu %6lu %5lu %8lu %8lu %8lu %8lu %7lu\n",
+            GetCommandName(os.opcode), os.count, os.errors, os.retries,
+            os.min_us, avg_us, PercentileMicroseconds(os, 95), os.max_us, kbps);
+        if (os.errors > 0) {
+            fprintf(out, "%-20s last error status %#x, %#x, %#x\n",
+                "", os.last_status, os.last_hastat, os.last_targstat);
+        }
+    }
+
+    return scsi_ms;
+}
+
+void StatsPrint(FILE *out)
+{
+    unsigned long wall_ms = (unsigned long)(clock() - _stats_start) * 1000 / CLOCKS_PER_SEC;
+    unsigned long scsi_ms = StatsPrintTable(out);
+
+    // Time not spent inside SCSI commands goes to the local disk, console and processing
+    fprintf(out, "Total time %lu ms, in SCSI commands %lu ms, elsewhere %lu ms\n",
+        wall_ms, scsi_ms, wall_ms > scsi_ms ? wall_ms - scsi_ms : 0);
+
+    unsigned int arena_size, arena_peak;
+    unsigned long arena_allocs;
+    ArenaGetUsage(arena_size, arena_peak, arena_allocs);
+    fprintf(out, "Arena %u bytes, peak %u bytes in %lu allocations\n",
+        arena_size, arena_peak, arena_allocs);
+    fprintf(out, "Command buffers peak %lu bytes in %lu allocations\n",
+        _heap_peak, _heap_allocs);
+    if (_dma_realigned > 0) {
+        fprintf(out, "Command buffers moved to avoid DMA bounce buffering: %lu\n", _dma_realigned);
+    }
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <i86.h>
 
 #include "../include/aspi.h"
 #include "../include/scsidefs.h"
@@ -27,54 +28,173 @@
 #include "../include/estb.h"
 
 
-bool ToolboxGetImageList(const Device &dev, WCValOrderedVector<ToolboxFileEntry> &images)
+int _toolbox_retries = 3;
+
+/* Decide whether a failed command should be sent again, and if so wait a bit first.
+ * The wait doubles for each attempt, to give a busy or recovering device time. */
+static bool WaitBeforeRetry(const Device &dev, const ScsiCommand &cmd, int attempt)
 {
-    ScsiCommand *cmd = dev.PrepareCommand(10, 1, SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return false;
+    const unsigned int FIRST_DELAY_MS = 50;
+    const unsigned int MAX_DELAY_MS = 1000;
 
-    // Send TOOLBOX_COUNT_CDS command
-    cmd->cdb[0] = TOOLBOX_COUNT_CDS;
-    
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_COUNT_CDS", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_COUNT_CDS was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
+    if (attempt >= _toolbox_retries) return false;
+    if (ClassifyScsiError(cmd.GetStatus(), cmd.GetHAStatus(), cmd.GetTargetStatus(),
+            cmd.GetSenseData()) != SCSI_ERROR_RETRY) {
+        return false;
     }
 
-    size_t count = cmd->data_buf[0];
-    images.clear();
-    if (count < 1) return false;
-    if (count > MAX_FILE_LISTING_FILES) count = MAX_FILE_LISTING_FILES;
-    //images.reserve(count);
+    unsigned int delay_ms = FIRST_DELAY_MS << (attempt < 5 ? attempt : 5);
+    if (delay_ms > MAX_DELAY_MS) delay_ms = MAX_DELAY_MS;
 
-    delete cmd;
+    fprintf(stderr, "[%s] Retrying %s (%d of %d)...\n",
+        dev.name, GetCommandName(cmd.cdb[0]), attempt + 1, _toolbox_retries);
+    StatsRecordRetry(cmd.cdb[0]);
+    delay(delay_ms);
+    return true;
+}
 
-    // Send TOOLBOX_LIST_CDS command
-    const int BUFSIZE = count * sizeof(ToolboxFileEntry);
-    cmd = dev.PrepareCommand(10, BUFSIZE, SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return false;
 
-    cmd->cdb[0] = TOOLBOX_LIST_CDS;
+/* Position of an argument in the CDB, stored big endian */
+struct CdbField {
+    unsigned char offset;
+    unsigned char width;        /* in bytes, 0 when not used */
+};
+
+/* Static description of a toolbox or standard SCSI command, see ToolboxPrepare and ToolboxExecute */
+struct ToolboxCommand {
+    const char *name;
+    unsigned char opcode;
+    unsigned char cdbsize;
+    unsigned char flags;        /* SRB_DIR_IN or SRB_DIR_OUT */
+    unsigned short bufsize;     /* data length, 0 when given for each command */
+    bool report_errors;         /* print status and sense data on failure */
+    bool retry;                 /* safe to send again after a transient error */
+    CdbField args[2];
+};
+
+#define TB_IN   (SRB_DIR_IN | SRB_DIR_SCSI)
+#define TB_OUT  (SRB_DIR_OUT | SRB_DIR_SCSI)
+#define NO_ARG  { 0, 0 }
+
+static const ToolboxCommand TB_COUNT_CDS =
+    { "TOOLBOX_COUNT_CDS", TOOLBOX_COUNT_CDS, 10, TB_IN, 1, true, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand TB_LIST_CDS =
+    { "TOOLBOX_LIST_CDS", TOOLBOX_LIST_CDS, 10, TB_IN, 0, true, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand TB_SET_NEXT_CD =
+    { "TOOLBOX_SET_NEXT_CD", TOOLBOX_SET_NEXT_CD, 10, TB_IN, 0, true, false, { { 1, 1 }, NO_ARG } };
+static const ToolboxCommand TB_COUNT_FILES =
+    { "TOOLBOX_COUNT_FILES", TOOLBOX_COUNT_FILES, 10, TB_IN, 1, true, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand TB_LIST_FILES =
+    { "TOOLBOX_LIST_FILES", TOOLBOX_LIST_FILES, 10, TB_IN, 0, true, false, { NO_ARG, NO_ARG } };
+/* Blocks are addressed explicitly, so the same block can be requested or sent again */
+static const ToolboxCommand TB_GET_FILE =
+    { "TOOLBOX_GET_FILE", TOOLBOX_GET_FILE, 10, TB_IN, 0, true, true, { { 1, 1 }, { 2, 4 } } };
+static const ToolboxCommand TB_SEND_FILE_PREP =
+    { "TOOLBOX_SEND_FILE_PREP", TOOLBOX_SEND_FILE_PREP, 10, TB_OUT, 33, true, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand TB_SEND_FILE_10 =
+    { "TOOLBOX_SEND_FILE_10", TOOLBOX_SEND_FILE_10, 10, TB_OUT, 512, true, true, { { 1, 2 }, { 3, 3 } } };
+static const ToolboxCommand TB_SEND_FILE_END =
+    { "TOOLBOX_SEND_FILE_END", TOOLBOX_SEND_FILE_END, 10, TB_OUT, 4, true, false, { NO_ARG, NO_ARG } };
+/* Devices without the toolbox reject these, which is not an error worth reporting */
+static const ToolboxCommand TB_LIST_DEVICES =
+    { "TOOLBOX_LIST_DEVICES", TOOLBOX_LIST_DEVICES, 10, TB_IN, sizeof(ToolboxDeviceList), false, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand TB_GET_DEBUG =
+    { "TOOLBOX_TOGGLE_DEBUG(get)", TOOLBOX_TOGGLE_DEBUG, 10, TB_IN, 1, false, false, { { 1, 1 }, NO_ARG } };
+static const ToolboxCommand TB_SET_DEBUG =
+    { "TOOLBOX_TOGGLE_DEBUG(set)", TOOLBOX_TOGGLE_DEBUG, 10, TB_IN, 0, false, false, { { 1, 1 }, { 2, 1 } } };
+/* Standard commands, used to image the emulated disk itself and to probe the device */
+static const ToolboxCommand BLK_TEST_UNIT_READY =
+    { "TEST_UNIT_READY", SCSI_TST_U_RDY, 6, SRB_DIR_SCSI, 0, false, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand BLK_READ_CAPACITY =
+    { "READ_CAPACITY", SCSI_RD_CAPAC, 10, TB_IN, 8, true, false, { NO_ARG, NO_ARG } };
+static const ToolboxCommand BLK_READ10 =
+    { "READ10", SCSI_READ10, 10, TB_IN, 0, true, true, { { 2, 4 }, { 7, 2 } } };
+static const ToolboxCommand BLK_WRITE10 =
+    { "WRITE10", SCSI_WRITE10, 10, TB_OUT, 0, true, true, { { 2, 4 }, { 7, 2 } } };
+
+
+static void EncodeCdbField(unsigned char far *cdb, const CdbField &field, unsigned long value)
+{
+    for (int i = field.width; i > 0; i--) {
+        cdb[field.offset + i - 1] = (unsigned char)value;
+        value >>= 8;
+    }
+}
 
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_LIST_CDS", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_LIST_CDS was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
+/* Get a command from the pool with the opcode and arguments filled in.
+ * The buffer size is only used for commands without a fixed size. */
+static ScsiCommand *ToolboxPrepare(const Device &dev, const ToolboxCommand &tc,
+    unsigned long arg0 = 0, unsigned long arg1 = 0, int bufsize = 0)
+{
+    ScsiCommand *cmd = dev.PrepareCommand(tc.cdbsize, tc.bufsize ? tc.bufsize : bufsize, tc.flags);
+    if (cmd == NULL) return NULL;
+
+    cmd->cdb[0] = tc.opcode;
+    EncodeCdbField(cmd->cdb, tc.args[0], arg0);
+    EncodeCdbField(cmd->cdb, tc.args[1], arg1);
+    return cmd;
+}
+
+/* Check the result of a sent command, resending it on transient errors when the
+ * command allows it. Returns the ASPI status, on failure the command has been released. */
+static unsigned short ToolboxComplete(const Device &dev, const ToolboxCommand &tc, ScsiCommand *cmd,
+    unsigned short status)
+{
+    for (int attempt = 0; ; attempt++, status = cmd->Execute()) {
+        if (status == SS_COMP) return status;
+
+        if (status == SS_PENDING) {
+            fprintf(stderr, "[%s] Timeout waiting for %s\n", dev.name, tc.name);
+        } else if (tc.report_errors) {
+            fprintf(stderr, "[%s] Return from SCSI command %s was %#x, %#x, %#x\n",
+                dev.name, tc.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
             PrintSense(cmd->GetSenseData());
-            return false;
+            if (tc.retry && WaitBeforeRetry(dev, *cmd, attempt)) continue;
+        }
+        cmd->Release();
+        return status;
     }
+}
+
+/* Send a prepared command and wait for it, see ToolboxComplete */
+static unsigned short ToolboxExecute(const Device &dev, const ToolboxCommand &tc, ScsiCommand *cmd)
+{
+    return ToolboxComplete(dev, tc, cmd, cmd->Execute());
+}
+
+/* Send a command without data, or with data that is not used */
+static bool ToolboxSimpleCommand(const Device &dev, const ToolboxCommand &tc,
+    unsigned long arg0 = 0, unsigned long arg1 = 0)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, tc, arg0, arg1);
+    if (cmd == NULL) return false;
+    if (ToolboxExecute(dev, tc, cmd) != SS_COMP) return false;
+    cmd->Release();
+    return true;
+}
+
+/* Image and shared directory listings both first ask for the number of
+ * entries, then fetch them all in one command. */
+static bool ToolboxFetchListing(const Device &dev, const ToolboxCommand &count_tc, const ToolboxCommand &list_tc,
+    FixedVector<ToolboxFileEntry> &files, bool empty_ok)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, count_tc);
+    if (cmd == NULL) return false;
+    if (ToolboxExecute(dev, count_tc, cmd) != SS_COMP) return false;
+
+    size_t count = cmd->data_buf[0];
+    files.clear();
+    cmd->Release();
+    if (count < 1) return empty_ok;
+    if (count > MAX_FILE_LISTING_FILES) count = MAX_FILE_LISTING_FILES;
+    if (!files.reserve(count)) {
+        fprintf(stderr, "[%s] Out of memory for %u files\n", dev.name, count);
+        return false;
+    }
+
+    cmd = ToolboxPrepare(dev, list_tc, 0, 0, count * sizeof(ToolboxFileEntry));
+    if (cmd == NULL) return false;
+    if (ToolboxExecute(dev, list_tc, cmd) != SS_COMP) return false;
 
     BYTE far *buf = cmd->data_buf;
     while (count > 0) {
@@ -82,264 +202,303 @@ bool ToolboxGetImageList(const Device &dev, WCValOrderedVector<ToolboxFileEntry>
         _fmemcpy(&tfe, buf, sizeof(tfe));
         buf += sizeof(tfe);
         if (tfe.name[0] == '\0') break;
-        images.append(tfe);
+        files.append(tfe);
         count--;
     }
 
-    delete cmd;
+    cmd->Release();
     return true;
 }
 
 
-bool ToolboxSetImage(const Device &dev, int newimage)
+/* When running a script, listings are kept for the following commands on the
+ * same device. The cache storage is allocated at full size the first time, so
+ * it never has to grow. Uploading a file clears the shared directory cache. */
+struct ListingCache {
+    const Device *dev;
+    bool valid;
+    bool result;
+    FixedVector<ToolboxFileEntry> files;
+};
+
+static bool _listing_cache_enabled = false;
+static ListingCache _image_cache;
+static ListingCache _shared_dir_cache;
+
+void ToolboxEnableListingCache(void)
 {
-    ScsiCommand *cmd = dev.PrepareCommand(10, 0, SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return 0;
-    
-    cmd->cdb[0] = TOOLBOX_SET_NEXT_CD;
-    cmd->cdb[1] = (unsigned char)newimage;
-    
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_SET_NEXT_CD", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_SET_NEXT_CD was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
-    }
+    _listing_cache_enabled = true;
+}
 
-    delete cmd;
-    return true;
+void ToolboxInvalidateListingCache(void)
+{
+    _image_cache.valid = false;
+    _shared_dir_cache.valid = false;
 }
 
+unsigned int ToolboxListingCacheSize(void)
+{
+    if (!_listing_cache_enabled) return 0;
+    // Both caches, and slack for listings freed out of order around the first fill
+    return 3 * MAX_FILE_LISTING_FILES * sizeof(ToolboxFileEntry);
+}
 
-bool ToolboxGetSharedDirList(const Device &dev, WCValOrderedVector<ToolboxFileEntry> &images)
+static bool ToolboxGetListing(const Device &dev, const ToolboxCommand &count_tc, const ToolboxCommand &list_tc,
+    FixedVector<ToolboxFileEntry> &files, bool empty_ok, ListingCache &cache)
 {
-    ScsiCommand *cmd = dev.PrepareCommand(10, 1, SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return false;
+    if (!_listing_cache_enabled) {
+        return ToolboxFetchListing(dev, count_tc, list_tc, files, empty_ok);
+    }
 
-    // Send TOOLBOX_COUNT_FILES command
-    cmd->cdb[0] = TOOLBOX_COUNT_FILES;
-    
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_COUNT_FILES", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_COUNT_FILES was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
+    if (!cache.valid || cache.dev != &dev) {
+        if (!cache.files.reserve(MAX_FILE_LISTING_FILES)) {
+            return ToolboxFetchListing(dev, count_tc, list_tc, files, empty_ok);
+        }
+        cache.result = ToolboxFetchListing(dev, count_tc, list_tc, cache.files, empty_ok);
+        // Errors are not cached, the next command tries again
+        cache.valid = cache.result;
+        cache.dev = &dev;
+        if (!cache.result) return false;
     }
 
-    size_t count = cmd->data_buf[0];
-    images.clear();
-    if (count < 1) return false;
-    if (count > MAX_FILE_LISTING_FILES) count = MAX_FILE_LISTING_FILES;
-    //images.reserve(count);
+    files.clear();
+    if (!files.reserve(cache.files.entries())) {
+        fprintf(stderr, "[%s] Out of memory for %d files\n", dev.name, cache.files.entries());
+        return false;
+    }
+    for (int i = 0; i < cache.files.entries(); i++) {
+        files.append(cache.files[i]);
+    }
+    return cache.result;
+}
 
-    delete cmd;
 
-    // Send TOOLBOX_LIST_FILES command
-    const int BUFSIZE = count * sizeof(ToolboxFileEntry);
-    cmd = dev.PrepareCommand(10, BUFSIZE, SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return false;
+/* Listings from several devices are fetched with the commands posted together,
+ * so the devices work on them at the same time. Fewer are posted at once than
+ * the command pool holds, leaving a command free for other uses. */
+static const int TOOLBOX_FANOUT = 3;
 
-    cmd->cdb[0] = TOOLBOX_LIST_FILES;
+/* Post a listing command to the devices from first on, as many as fit in one batch.
+ * With counts given, the listing buffer is sized from them, and devices with
+ * nothing to list get no command. Returns the number of devices covered. */
+static int ToolboxPostBatch(const FixedVector<const Device *> &devs, int first, const ToolboxCommand &tc,
+    const FixedVector<int> *counts, ScsiCommand *cmds[TOOLBOX_FANOUT])
+{
+    int n = 0;
+    for (int i = first; i < devs.entries() && n < TOOLBOX_FANOUT; i++, n++) {
+        int count = counts != NULL ? (*counts)[i] : 0;
+        cmds[n] = NULL;
+        if (counts != NULL && count <= 0) continue;
+        cmds[n] = ToolboxPrepare(*devs[i], tc, 0, 0, count * sizeof(ToolboxFileEntry));
+        if (cmds[n] != NULL) cmds[n]->Post();
+    }
+    return n;
+}
 
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_LIST_FILES", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_LIST_FILES was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
+int ToolboxCountAll(const FixedVector<const Device *> &devs, bool images, FixedVector<int> &counts)
+{
+    const ToolboxCommand &tc = images ? TB_COUNT_CDS : TB_COUNT_FILES;
+    int total = 0;
+
+    counts.clear();
+    for (int first = 0; first < devs.entries(); ) {
+        ScsiCommand *cmds[TOOLBOX_FANOUT];
+        int batch = ToolboxPostBatch(devs, first, tc, NULL, cmds);
+        for (int j = 0; j < batch; j++) {
+            ScsiCommand *cmd = cmds[j];
+            int count = -1;
+            if (cmd != NULL && ToolboxComplete(*devs[first + j], tc, cmd, cmd->Wait()) == SS_COMP) {
+                count = cmd->data_buf[0];
+                if (count > MAX_FILE_LISTING_FILES) count = MAX_FILE_LISTING_FILES;
+                total += count;
+                cmd->Release();
+            }
+            counts.append(count);
+        }
+        first += batch;
     }
+    return total;
+}
 
-    BYTE far *buf = cmd->data_buf;
-    while (count > 0) {
-        ToolboxFileEntry tfe;
-        _fmemcpy(&tfe, buf, sizeof(tfe));
-        buf += sizeof(tfe);
-        if (tfe.name[0] == '\0') break;
-        images.append(tfe);
-        count--;
+int ToolboxListAll(const FixedVector<const Device *> &devs, bool images, const FixedVector<int> &counts,
+    CatalogEntry catalog[], int capacity)
+{
+    const ToolboxCommand &tc = images ? TB_LIST_CDS : TB_LIST_FILES;
+    int entries = 0;
+
+    for (int first = 0; first < devs.entries(); ) {
+        ScsiCommand *cmds[TOOLBOX_FANOUT];
+        int batch = ToolboxPostBatch(devs, first, tc, &counts, cmds);
+        for (int j = 0; j < batch; j++) {
+            ScsiCommand *cmd = cmds[j];
+            const Device *dev = devs[first + j];
+            if (cmd == NULL || ToolboxComplete(*dev, tc, cmd, cmd->Wait()) != SS_COMP) continue;
+
+            BYTE far *buf = cmd->data_buf;
+            for (int count = counts[first + j]; count > 0 && entries < capacity; count--) {
+                CatalogEntry &ce = catalog[entries];
+                _fmemcpy(&ce.file, buf, sizeof(ce.file));
+                buf += sizeof(ce.file);
+                if (ce.file.name[0] == '\0') break;
+                ce.dev = dev;
+                entries++;
+            }
+            cmd->Release();
+        }
+        first += batch;
     }
+    return entries;
+}
 
-    delete cmd;
-    return true;
+
+bool ToolboxGetImageList(const Device &dev, FixedVector<ToolboxFileEntry> &images)
+{
+    return ToolboxGetListing(dev, TB_COUNT_CDS, TB_LIST_CDS, images, false, _image_cache);
+}
+
+
+bool ToolboxSetImage(const Device &dev, int newimage)
+{
+    return ToolboxSimpleCommand(dev, TB_SET_NEXT_CD, (unsigned char)newimage);
+}
+
+
+bool ToolboxGetSharedDirList(const Device &dev, FixedVector<ToolboxFileEntry> &images)
+{
+    // An empty shared directory is a valid result
+    return ToolboxGetListing(dev, TB_COUNT_FILES, TB_LIST_FILES, images, true, _shared_dir_cache);
 }
 
 
 int ToolboxGetFileBlock(const Device &dev, int fileindex, unsigned long blockindex, unsigned char databuf[], int bufsize)
 {
-    ScsiCommand *cmd = dev.PrepareCommand(10, bufsize, SRB_DIR_IN | SRB_DIR_SCSI);
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_GET_FILE, (unsigned char)fileindex, blockindex, bufsize);
     if (cmd == NULL) return -1;
+    if (ToolboxExecute(dev, TB_GET_FILE, cmd) != SS_COMP) return -1;
 
-    cmd->cdb[0] = TOOLBOX_GET_FILE;
-    cmd->cdb[1] = (unsigned char)fileindex;
-    cmd->cdb[2] = (unsigned char)(blockindex >> 24) & 0xFF;
-    cmd->cdb[3] = (unsigned char)(blockindex >> 16) & 0xFF;
-    cmd->cdb[4] = (unsigned char)(blockindex >>  8) & 0xFF;
-    cmd->cdb[5] = (unsigned char)(blockindex      ) & 0xFF;
+    _fmemcpy(databuf, cmd->data_buf, bufsize);
 
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_GET_FILE", dev.name);
-            return -1;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_GET_FILE was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return -1;
-    }
+    cmd->Release();
+    return bufsize;
+}
+
+ScsiCommand *ToolboxGetFileBlockStart(const Device &dev, int fileindex, unsigned long blockindex, int bufsize)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_GET_FILE, (unsigned char)fileindex, blockindex, bufsize);
+    if (cmd != NULL) cmd->Post();
+    return cmd;
+}
+
+int ToolboxGetFileBlockFinish(const Device &dev, ScsiCommand *cmd, unsigned char databuf[], int bufsize)
+{
+    if (cmd == NULL) return -1;
+    if (ToolboxComplete(dev, TB_GET_FILE, cmd, cmd->Wait()) != SS_COMP) return -1;
 
     _fmemcpy(databuf, cmd->data_buf, bufsize);
 
-    delete cmd;
+    cmd->Release();
     return bufsize;
 }
 
-bool ToolboxSendFileBegin(const Device &dev, const char far *filename)
+int ToolboxCountFiles(const Device &dev)
 {
-    const int BUFSIZE = 33;
-    
-    ScsiCommand *cmd = dev.PrepareCommand(10, BUFSIZE, SRB_DIR_OUT | SRB_DIR_SCSI);
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_COUNT_FILES);
     if (cmd == NULL) return -1;
+    if (ToolboxExecute(dev, TB_COUNT_FILES, cmd) != SS_COMP) return -1;
 
-    cmd->cdb[0] = TOOLBOX_SEND_FILE_PREP;
+    int count = cmd->data_buf[0];
+
+    cmd->Release();
+    return count;
+}
+
+bool ToolboxSendFileBegin(const Device &dev, const char far *filename)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_SEND_FILE_PREP);
+    if (cmd == NULL) return false;
 
     size_t fnlen = strlen(filename);
-    if (fnlen >= BUFSIZE) fnlen = BUFSIZE - 1;
+    if (fnlen >= TB_SEND_FILE_PREP.bufsize) fnlen = TB_SEND_FILE_PREP.bufsize - 1;
     _fmemcpy(cmd->data_buf, filename, fnlen);
 
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_SEND_FILE_PREP", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_SEND_FILE_PREP was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
-    }
-
-    delete cmd;
+    if (ToolboxExecute(dev, TB_SEND_FILE_PREP, cmd) != SS_COMP) return false;
+    cmd->Release();
     return true;
 }
 
-bool ToolboxSendFileBlock(const Device &dev, unsigned short data_size, unsigned long block_index, const char far *data)
+ScsiCommand *ToolboxSendFileBlockStart(const Device &dev, unsigned short data_size, unsigned long block_index, const char far *data)
 {
-    const int BUFSIZE = 512;
-
-    if (data_size > BUFSIZE) fprintf(stderr, "Illegal data_size\n"), abort();
+    if (data_size > TB_SEND_FILE_10.bufsize) fprintf(stderr, "Illegal data_size\n"), abort();
     if (block_index >> 24 > 0) fprintf(stderr, "Illegal block_index\n"), abort();
 
-    ScsiCommand *cmd = dev.PrepareCommand(10, BUFSIZE, SRB_DIR_OUT | SRB_DIR_SCSI);
-    if (cmd == NULL) return -1;
-
-    cmd->cdb[0] = TOOLBOX_SEND_FILE_10;
-    cmd->cdb[1] = (unsigned char)((0xFF00 & data_size) >>  8);
-    cmd->cdb[2] = (unsigned char)((0x00FF & data_size)      );
-    cmd->cdb[3] = (unsigned char)((0xFF0000 & block_index) >> 16);
-    cmd->cdb[4] = (unsigned char)((0x00FF00 & block_index) >>  8);
-    cmd->cdb[5] = (unsigned char)((0x0000FF & block_index)      );
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_SEND_FILE_10, data_size, block_index);
+    if (cmd == NULL) return NULL;
     _fmemcpy(cmd->data_buf, data, data_size);
+    cmd->Post();
+    return cmd;
+}
 
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_SEND_FILE_10", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_SEND_FILE_10 was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
-    }
-
-    delete cmd;
+bool ToolboxSendFileBlockFinish(const Device &dev, ScsiCommand *cmd)
+{
+    if (cmd == NULL) return false;
+    if (ToolboxComplete(dev, TB_SEND_FILE_10, cmd, cmd->Wait()) != SS_COMP) return false;
+    cmd->Release();
     return true;
 }
 
-bool ToolboxSendFileEnd(const Device &dev)
+bool ToolboxSendFileBlock(const Device &dev, unsigned short data_size, unsigned long block_index, const char far *data)
 {
-    const int BUFSIZE = 4;
-    
-    ScsiCommand *cmd = dev.PrepareCommand(10, BUFSIZE, SRB_DIR_OUT | SRB_DIR_SCSI);
-    if (cmd == NULL) return -1;
-
-    cmd->cdb[0] = TOOLBOX_SEND_FILE_END;
+    return ToolboxSendFileBlockFinish(dev, ToolboxSendFileBlockStart(dev, data_size, block_index, data));
+}
 
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_SEND_FILE_END", dev.name);
-            return false;
-        default:
-            fprintf(stderr, "[%s] Return from SCSI command TOOLBOX_SEND_FILE_END was %#x, %#x, %#x\n",
-                dev.name, cmd->GetStatus(), cmd->GetHAStatus(), cmd->GetTargetStatus());
-            PrintSense(cmd->GetSenseData());
-            return false;
+void ToolboxSendFileBlockAll(const FixedVector<const Device *> &devs, FixedVector<int> &status,
+    unsigned short data_size, unsigned long block_index, const char far *data)
+{
+    for (int first = 0; first < devs.entries(); ) {
+        ScsiCommand *cmds[TOOLBOX_FANOUT];
+        int indexes[TOOLBOX_FANOUT];
+        int n = 0;
+        int i;
+        for (i = first; i < devs.entries() && n < TOOLBOX_FANOUT; i++) {
+            if (status[i] != 0) continue;
+            indexes[n] = i;
+            cmds[n++] = ToolboxSendFileBlockStart(*devs[i], data_size, block_index, data);
+        }
+        for (int j = 0; j < n; j++) {
+            if (!ToolboxSendFileBlockFinish(*devs[indexes[j]], cmds[j])) status[indexes[j]] = 18;
+        }
+        first = i;
     }
+}
 
-    delete cmd;
-    return true;
+bool ToolboxSendFileEnd(const Device &dev)
+{
+    // The new file changes the shared directory listing
+    _shared_dir_cache.valid = false;
+    return ToolboxSimpleCommand(dev, TB_SEND_FILE_END);
 }
 
 bool ToolboxListDevices(const Device &dev, ToolboxDeviceList &devlist)
 {
-    ScsiCommand *cmd = dev.PrepareCommand(10, sizeof(devlist), SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return -1;
-
-    cmd->cdb[0] = TOOLBOX_LIST_DEVICES;
-
-    switch (cmd->Execute()) {
-        case SS_COMP:
-            break;
-        case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_LIST_DEVICES", dev.name);
-            return false;
-        default:
-            return false;
-    }
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_LIST_DEVICES);
+    if (cmd == NULL) return false;
+    if (ToolboxExecute(dev, TB_LIST_DEVICES, cmd) != SS_COMP) return false;
 
     _fmemcpy(&devlist, cmd->data_buf, sizeof(devlist));
 
-    delete cmd;
+    cmd->Release();
     return true;
 }
 
 int ToolboxGetDebugFlag(const Device &dev)
 {
-    const int BUFSIZE = 1;
-    ScsiCommand *cmd = dev.PrepareCommand(10, BUFSIZE, SRB_DIR_IN | SRB_DIR_SCSI);
+    ScsiCommand *cmd = ToolboxPrepare(dev, TB_GET_DEBUG, 1); // get debug state
     if (cmd == NULL) return -1;
 
-    cmd->cdb[0] = TOOLBOX_TOGGLE_DEBUG;
-    cmd->cdb[1] = 1; // get debug state
-
-    switch (cmd->Execute()) {
+    switch (ToolboxExecute(dev, TB_GET_DEBUG, cmd)) {
         case SS_COMP:
             break;
         case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_TOGGLE_DEBUG(get)", dev.name);
             return -1;
         default:
             return -2;
@@ -347,30 +506,91 @@ int ToolboxGetDebugFlag(const Device &dev)
 
     int debug_flag = cmd->data_buf[0];
 
-    delete cmd;
+    cmd->Release();
     return debug_flag;
 }
 
 bool ToolboxSetDebugFlag(const Device &dev, bool debug_enabled)
 {
-    ScsiCommand *cmd = dev.PrepareCommand(10, 0, SRB_DIR_IN | SRB_DIR_SCSI);
-    if (cmd == NULL) return -1;
+    // set debug state
+    return ToolboxSimpleCommand(dev, TB_SET_DEBUG, 0, debug_enabled ? 1 : 0);
+}
 
-    cmd->cdb[0] = TOOLBOX_TOGGLE_DEBUG;
-    cmd->cdb[1] = 0; // set debug state
-    cmd->cdb[2] = debug_enabled ? 1 : 0;
+int DeviceTestUnitReady(const Device &dev, SENSE_DATA_FMT *sense)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, BLK_TEST_UNIT_READY);
+    if (cmd == NULL) return -1;
 
+    int result;
     switch (cmd->Execute()) {
         case SS_COMP:
+            result = 1;
             break;
         case SS_PENDING:
-            fprintf(stderr, "[%s] Timeout waiting for TOOLBOX_TOGGLE_DEBUG(set)", dev.name);
-            return false;
+            fprintf(stderr, "[%s] Timeout waiting for %s\n", dev.name, BLK_TEST_UNIT_READY.name);
+            result = -1;
+            break;
         default:
-            return false;
+            // Not ready is reported as a check condition, with the reason in the sense data
+            if (cmd->GetHAStatus() != HASTAT_OK || cmd->GetTargetStatus() != STATUS_CHKCOND) {
+                result = -1;
+                break;
+            }
+            // Only SENSE_LEN bytes of sense data are requested, the rest reads as zero
+            if (sense != NULL) {
+                _fmemset(sense, 0, sizeof(*sense));
+                _fmemcpy(sense, cmd->GetSenseData(), SENSE_LEN);
+            }
+            result = 0;
+            break;
     }
 
-    delete cmd;
+    cmd->Release();
+    return result;
+}
+
+static unsigned long DecodeBigEndian32(const unsigned char far *p)
+{
+    return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 | (unsigned long)p[2] << 8 | p[3];
+}
+
+bool DeviceReadCapacity(const Device &dev, unsigned long &blocks, unsigned long &blocksize)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, BLK_READ_CAPACITY);
+    if (cmd == NULL) return false;
+    if (ToolboxExecute(dev, BLK_READ_CAPACITY, cmd) != SS_COMP) return false;
+
+    // The device reports the address of the last block, not the number of blocks
+    blocks = DecodeBigEndian32(cmd->data_buf) + 1;
+    blocksize = DecodeBigEndian32(cmd->data_buf + 4);
+
+    cmd->Release();
+    return true;
+}
+
+ScsiCommand *DeviceReadBlocksStart(const Device &dev, unsigned long lba, unsigned short count, int bufsize)
+{
+    ScsiCommand *cmd = ToolboxPrepare(dev, BLK_READ10, lba, count, bufsize);
+    if (cmd != NULL) cmd->Post();
+    return cmd;
+}
+
+bool DeviceReadBlocksFinish(const Device &dev, ScsiCommand *cmd)
+{
+    if (cmd == NULL) return false;
+    return ToolboxComplete(dev, BLK_READ10, cmd, cmd->Wait()) == SS_COMP;
+}
+
+ScsiCommand *DeviceWriteBlocksPrepare(const Device &dev, unsigned long lba, unsigned short count, int bufsize)
+{
+    return ToolboxPrepare(dev, BLK_WRITE10, lba, count, bufsize);
+}
+
+bool DeviceWriteBlocksFinish(const Device &dev, ScsiCommand *cmd)
+{
+    if (cmd == NULL) return false;
+    if (ToolboxComplete(dev, BLK_WRITE10, cmd, cmd->Wait()) != SS_COMP) return false;
+    cmd->Release();
     return true;
 }
 
@@ -0,0 +1,128 @@
+/**
+ * Copyright (C) 2025 Niels Martin Hansen
+ *
+ * This file is part of the Emulated SCSI Toolbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/aspi.h"
+#include "../include/scsidefs.h"
+#include "../include/estb.h"
+
+
+/* Trace file layout:
+ *  TraceFileHeader, followed by any number of TraceRecord,
+ *  each record followed by sense_len bytes of sense data.
+ *  Sense data is only stored for commands that did not complete successfully,
+ *  keeping the trace of a long transfer small.
+ *  All values are stored little endian. */
+
+static const char TRACE_MAGIC[4] = { 'S', 'T', 'B', 'T' };
+
+bool _trace_enabled = false;
+static FILE *_tracefile = NULL;
+
+
+bool TraceBegin(const char *filename)
+{
+    // Starting a new trace completes the previous one
+    TraceEnd();
+
+    _tracefile = fopen(filename, "wb");
+    if (_tracefile == NULL) return false;
+
+    TraceFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(TraceRecord);
+    hdr.ticks_per_sec = 1193182UL;
+    fwrite(&hdr, sizeof(hdr), 1, _tracefile);
+
+    InitTimer();
+    _trace_enabled = true;
+    return true;
+}
+
+void TraceRecordCommand(const ScsiCommand &cmd, unsigned long start_ticks, unsigned long elapsed_ticks)
+{
+    TraceRecord rec;
+    const SENSE_DATA_FMT far *sense = cmd.GetSenseData();
+
+    memset(&rec, 0, sizeof(rec));
+    rec.start_ticks = start_ticks;
+    rec.elapsed_ticks = elapsed_ticks;
+    rec.buflen = cmd.GetBufSize();
+    rec.adapter_id = cmd.device->adapter_id;
+    rec.target_id = cmd.device->target_id;
+    rec.lun = cmd.device->lun;
+    rec.flags = cmd.GetFlags();
+    rec.cdblen = cmd.GetCDBSize();
+    _fmemcpy(rec.cdb, cmd.cdb, rec.cdblen);
+    rec.status = cmd.GetStatus();
+    rec.hastat = cmd.GetHAStatus();
+    rec.targstat = cmd.GetTargetStatus();
+    rec.sense_len = rec.status == SS_COMP ? 0 : SENSE_LEN;
+
+    fwrite(&rec, sizeof(rec), 1, _tracefile);
+    if (rec.sense_len > 0) {
+        unsigned char sensebuf[SENSE_LEN];
+        _fmemcpy(sensebuf, sense, SENSE_LEN);
+        fwrite(sensebuf, SENSE_LEN, 1, _tracefile);
+    }
+}
+
+void TraceEnd(void)
+{
+    if (_tracefile == NULL) return;
+
+    _trace_enabled = false;
+    fclose(_tracefile);
+    _tracefile = NULL;
+}
+
+/* Traces can come from other machines or timer settings, so the recorded tick rate is used */
+bool TraceOpen(FILE *f, unsigned long &ticks_per_sec)
+{
+    TraceFileHeader hdr;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1) return false;
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) return false;
+    if (hdr.version != TRACE_VERSION || hdr.record_size != sizeof(TraceRecord)) return false;
+    // Higher rates would overflow the conversion to microseconds
+    if (hdr.ticks_per_sec == 0 || hdr.ticks_per_sec > 4000000UL) return false;
+    ticks_per_sec = hdr.ticks_per_sec;
+    return true;
+}
+
+unsigned long TraceTicksToMicroseconds(unsigned long ticks, unsigned long ticks_per_sec)
+{
+    // Split in whole seconds, milliseconds and the rest, keeping every product within 32 bits
+    unsigned long rem = ticks % ticks_per_sec * 1000;
+    return ticks / ticks_per_sec * 1000000UL + rem / ticks_per_sec * 1000 +
+        rem % ticks_per_sec * 1000 / ticks_per_sec;
+}
+
+bool TraceReadRecord(FILE *f, TraceRecord &rec, unsigned char sense[SENSE_LEN])
+{
+    if (fread(&rec, sizeof(rec), 1, f) != 1) return false;
+    memset(sense, 0, SENSE_LEN);
+    if (rec.sense_len > SENSE_LEN) return false;
+    if (rec.sense_len > 0 && fread(sense, rec.sense_len, 1, f) != 1) return false;
+    return true;
+}
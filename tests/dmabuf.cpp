@@ -0,0 +1,107 @@
+/** 
+ * Copyright (C) 2024 Niels Martin Hansen
+ * 
+ * This file is part of the Emulated SCSI Toolbox
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version. 
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details. 
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+**/
+
+/* Tests for DmaBufferOffset, built for and run on the build host.
+ * The shared code is included directly, with far pointers made plain. */
+
+#define far
+#include "../shared/scsishrd.cpp"
+
+static const unsigned long DMA_PAGE = 0x10000UL;
+static int _failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("%s(%d): failed: %s\n", __FILE__, __LINE__, #cond); _failures++; } } while (0)
+
+/* The placement must be aligned, inside the block and within one DMA page */
+static bool IsGoodPlacement(unsigned long phys, unsigned long blocksize, unsigned long bufsize, unsigned short align_mask, unsigned long offset)
+{
+    if (offset == DMA_NO_FIT) return false;
+    unsigned long start = phys + offset;
+    if ((start & align_mask) != 0) return false;
+    if (offset + bufsize > blocksize) return false;
+    return bufsize == 0 || start / DMA_PAGE == (start + bufsize - 1) / DMA_PAGE;
+}
+
+static void TestAlignment()
+{
+    // Already aligned stays in place
+    CHECK(DmaBufferOffset(0x20000UL, 0x203, 0x200, 3) == 0);
+    // Rounded up to the next aligned address
+    CHECK(DmaBufferOffset(0x12345UL, 0x10F, 0x100, 0xF) == 0xB);
+    CHECK(DmaBufferOffset(0x12341UL, 0x203, 0x200, 1) == 1);
+    // Not enough room left after aligning
+    CHECK(DmaBufferOffset(0x12345UL, 0x100, 0x100, 0xF) == DMA_NO_FIT);
+}
+
+static void TestPageCrossing()
+{
+    // Ending exactly at the page end does not cross it
+    CHECK(DmaBufferOffset(0x1FF00UL, 0x100, 0x100, 0) == 0);
+    // One byte more does, and the block has no room to move past the boundary
+    CHECK(DmaBufferOffset(0x1FF00UL, 0x101, 0x101, 0) == DMA_NO_FIT);
+    // With room, the buffer starts at the next page
+    CHECK(DmaBufferOffset(0x1FF00UL, 0x300, 0x200, 0) == 0x100);
+    // Larger than a page can never fit
+    CHECK(DmaBufferOffset(0x20000UL, 0x30000UL, 0x10001UL, 0) == DMA_NO_FIT);
+    CHECK(DmaBufferOffset(0x20000UL, 0x10000UL, 0x10000UL, 0) == 0);
+}
+
+/* AllocBuffer first tries a block of bufsize + align_mask, and when that is
+ * refused, one of 2 * bufsize + align_mask, which must fit wherever it lands */
+static void TestRetryBlockSize()
+{
+    static const unsigned long sizes[] = { 1, 512, 0x1000, 0x7FFF, 0x7FF0 };
+    static const unsigned short masks[] = { 0, 1, 3, 0xF };
+
+    for (int si = 0; si < (int)(sizeof(sizes) / sizeof(sizes[0])); si++) {
+        for (int mi = 0; mi < (int)(sizeof(masks) / sizeof(masks[0])); mi++) {
+            unsigned long bufsize = sizes[si];
+            unsigned short mask = masks[mi];
+            int first_refused = 0;
+            for (unsigned long phys = 0x08000UL; phys < 0x38000UL; phys += 0x1F) {
+                unsigned long first = DmaBufferOffset(phys, bufsize + mask, bufsize, mask);
+                if (first != DMA_NO_FIT) {
+                    CHECK(IsGoodPlacement(phys, bufsize + mask, bufsize, mask, first));
+                    continue;
+                }
+                first_refused++;
+                unsigned long blocksize = 2 * bufsize + mask;
+                unsigned long retry = DmaBufferOffset(phys, blocksize, bufsize, mask);
+                CHECK(IsGoodPlacement(phys, blocksize, bufsize, mask, retry));
+            }
+            // Buffers of more than a few bytes land on a page boundary somewhere
+            if (bufsize > 0x20) CHECK(first_refused > 0);
+        }
+    }
+}
+
+int main()
+{
+    TestAlignment();
+    TestPageCrossing();
+    TestRetryBlockSize();
+
+    if (_failures > 0) {
+        printf("%d checks failed\n", _failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}